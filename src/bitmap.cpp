@@ -1,4 +1,209 @@
 #include "bitmap.h"
+#if defined __AVX__
+#include <immintrin.h>
+#elif defined __SSE__
+#include <xmmintrin.h>
+#endif
+
+namespace {
+
+/** Vertical binomial filter of three rows: out = coef * (a + 2 * b + c)
+ */
+void binomial_rows(const float *a, const float *b, const float *c, float *out, int count, float coef)
+{
+    int i = 0;
+#if defined __AVX__
+    const __m256 coef8 = _mm256_set1_ps(coef);
+    for (; i + 8 <= count; i += 8) {
+        __m256 mid = _mm256_loadu_ps(b + i);
+        __m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(c + i)), _mm256_add_ps(mid, mid));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(sum, coef8));
+    }
+#endif
+#if defined __SSE__
+    const __m128 coef4 = _mm_set1_ps(coef);
+    for (; i + 4 <= count; i += 4) {
+        __m128 mid = _mm_loadu_ps(b + i);
+        __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(c + i)), _mm_add_ps(mid, mid));
+        _mm_storeu_ps(out + i, _mm_mul_ps(sum, coef4));
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = coef * (a[i] + 2 * b[i] + c[i]);
+    }
+}
+
+/** Difference of two rows: out = a - b
+ */
+void subtract_rows(const float *a, const float *b, float *out, int count)
+{
+    int i = 0;
+#if defined __AVX__
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+#endif
+#if defined __SSE__
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = a[i] - b[i];
+    }
+}
+
+/** Weighted sum of channels in a row of interleaved three-channel pixels
+ */
+void grayscale_row(const float *row, float *out, int count, Vector3 coef)
+{
+    int i = 0;
+#if defined __SSE__
+    const __m128 coef0 = _mm_set1_ps(coef[0]), coef1 = _mm_set1_ps(coef[1]), coef2 = _mm_set1_ps(coef[2]);
+    for (; i + 4 <= count; i += 4) {
+        // deinterleave four pixels (abca bcab cabc) into three vectors of single channels
+        const float *src = row + 3 * i;
+        __m128 v0 = _mm_loadu_ps(src), v1 = _mm_loadu_ps(src + 4), v2 = _mm_loadu_ps(src + 8);
+        __m128 a = _mm_shuffle_ps(_mm_shuffle_ps(v0, v0, _MM_SHUFFLE(3, 0, 3, 0)), _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 1, 0));
+        __m128 b = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 c = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, coef0), _mm_mul_ps(b, coef1)), _mm_mul_ps(c, coef2));
+        _mm_storeu_ps(out + i, sum);
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = coef[0] * row[3 * i] + coef[1] * row[3 * i + 1] + coef[2] * row[3 * i + 2];
+    }
+}
+
+/** Bilinear interpolation between two neighboring pixels on each of two rows
+ */
+template<typename T>
+inline T blend(const T *top, const T *bottom, float lr, float tb)
+{
+    return (1 - tb) * ((1 - lr) * top[0] + lr * top[1]) + tb * ((1 - lr) * bottom[0] + lr * bottom[1]);
+}
+
+#if defined __SSE__
+/** Load two consecutive three-channel pixels into separate registers, without reading past them
+ */
+inline void load_pair(const Vector3 *pixels, __m128 &left, __m128 &right)
+{
+    const float *data = pixels[0].val;
+    left = _mm_loadu_ps(data);
+    __m128 shifted = _mm_loadu_ps(data + 2);
+    right = _mm_shuffle_ps(shifted, shifted, _MM_SHUFFLE(3, 3, 2, 1));
+}
+
+template<>
+inline Vector3 blend(const Vector3 *top, const Vector3 *bottom, float lr, float tb)
+{
+    __m128 top_left, top_right, bottom_left, bottom_right;
+    load_pair(top, top_left, top_right);
+    load_pair(bottom, bottom_left, bottom_right);
+    const __m128 weight_lr = _mm_set1_ps(lr), weight_tb = _mm_set1_ps(tb);
+    __m128 upper = _mm_add_ps(top_left, _mm_mul_ps(weight_lr, _mm_sub_ps(top_right, top_left)));
+    __m128 lower = _mm_add_ps(bottom_left, _mm_mul_ps(weight_lr, _mm_sub_ps(bottom_right, bottom_left)));
+    float result[4];
+    _mm_storeu_ps(result, _mm_add_ps(upper, _mm_mul_ps(weight_tb, _mm_sub_ps(lower, upper))));
+    return Vector3(result[0], result[1], result[2]);
+}
+#endif
+
+/** Horizontal binomial filter of a row with interleaved channels, keeping every even pixel
+ * The left border is replicated, the right one is never reached.
+ */
+template<int channels>
+void binomial_decimate(const float *row, float *out, int out_count)
+{
+    for (int ch=0; ch<channels; ++ch) {
+        out[ch] = 3 * row[ch] + row[channels + ch];
+    }
+    for (int i=1; i<out_count; ++i) {
+        const float *src = row + 2 * i * channels;
+        float *dst = out + i * channels;
+        for (int ch=0; ch<channels; ++ch) {
+            dst[ch] = src[ch - channels] + 2 * src[ch] + src[ch + channels];
+        }
+    }
+}
+
+/** Offset of the maximum of a quadratic polynomial, given its gradient and Hessian at the origin
+ * Fits that are not concave give no offset, and the result never leaves the neighborhood.
+ */
+Vector2 quadratic_offset(float gx, float gy, float hxx, float hxy, float hyy)
+{
+    const float det = hxx * hyy - hxy * hxy;
+    if (not (hxx < 0 and det > 0)) {
+        return Vector2(0, 0);
+    }
+    return Vector2(clamp((hxy * gy - hyy * gx) / det, -1, 1), clamp((hxy * gx - hxx * gy) / det, -1, 1));
+}
+
+/** Maximum of a parabola through three equidistant samples, relative to the middle one
+ */
+float parabola_offset(float before, float middle, float after)
+{
+    const float curvature = after - 2 * middle + before;
+    return (curvature < 0) ? clamp(0.5 * (before - after) / curvature, -1, 1) : 0;
+}
+
+/** Least squares quadratic fit to whatever samples of the 3x3 neighborhood are finite
+ * @param values Samples indexed as values[y + 1][x + 1]
+ */
+Vector2 fit_incomplete(const float values[3][3])
+{
+    cv::Matx<float, 6, 6> normal = cv::Matx<float, 6, 6>::zeros();
+    cv::Matx<float, 6, 1> rhs = cv::Matx<float, 6, 1>::zeros();
+    int count = 0;
+    for (int y=-1; y<=1; ++y) {
+        for (int x=-1; x<=1; ++x) {
+            const float s = values[y + 1][x + 1];
+            if (not std::isfinite(s)) {
+                continue;
+            }
+            const float row[6] = {float(x * x), float(x * y), float(x), float(y * y), float(y), 1};
+            for (int i=0; i<6; ++i) {
+                for (int j=0; j<6; ++j) {
+                    normal(i, j) += row[i] * row[j];
+                }
+                rhs(i) += row[i] * s;
+            }
+            count += 1;
+        }
+    }
+    if (count < 6) {
+        return Vector2(0, 0);
+    }
+    const cv::Matx<float, 6, 1> v = normal.solve(rhs, cv::DECOMP_SVD);
+    return quadratic_offset(v(2), v(4), 2 * v(0), v(1), 2 * v(3));
+}
+
+/** Whether a pixel is a strict local maximum among its 8 neighbors
+ * Ties are resolved in favor of the pixel that comes first in row-major order, just like in cv::minMaxLoc.
+ */
+bool is_local_maximum(const Bitmap1 &score, int x, int y)
+{
+    const float s = score(y, x);
+    if (not std::isfinite(s)) {
+        return false;
+    }
+    for (int dy=-1; dy<=1; ++dy) {
+        for (int dx=-1; dx<=1; ++dx) {
+            if ((dx == 0 and dy == 0) or y + dy < 0 or y + dy >= score.rows or x + dx < 0 or x + dx >= score.cols) {
+                continue;
+            }
+            const float neighbor = score(y + dy, x + dx);
+            const bool is_before = dy < 0 or (dy == 0 and dx < 0);
+            if (is_before ? neighbor >= s : neighbor > s) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+} // end anonymous namespace
 
 template<typename T>
 inline Vector2 Bitmap<T>::to_local(Vector2 v) const
@@ -66,6 +271,23 @@ inline T Bitmap<T>::operator() (Vector2 world_pos) const
     return (1 - tb) * ((1 - lr) * top[left] + lr * top[right]) + tb * ((1 - lr) * bottom[left] + lr * bottom[right]);
 }
 
+template<typename T>
+void Bitmap<T>::sample(const Vector2 *positions, int count, T *out) const
+{
+    const float inv_scale = 1 / scale;
+    const float max_x = DataType::cols - 1, max_y = DataType::rows - 1;
+    for (int i=0; i<count; ++i) {
+        const float x = (positions[i][0] - offset[0]) * inv_scale, y = (positions[i][1] - offset[1]) * inv_scale;
+        if (0 <= x and x < max_x and 0 <= y and y < max_y and scale > 0) {
+            // interior: all four neighbors exist, so there is nothing to clamp
+            const int left = x, top = y;
+            out[i] = blend(DataType::template ptr<T>(top) + left, DataType::template ptr<T>(top + 1) + left, x - left, y - top);
+        } else {
+            out[i] = (*this)(positions[i]);
+        }
+    }
+}
+
 template<typename T>
 inline bool Bitmap<T>::contains(Vector2 world_pos) const
 {
@@ -147,11 +369,12 @@ Bitmap<T> Bitmap<T>::d(int direction, Rect rect) const
         rect.height -= 1;
         region_offset(1) += 0.5 * scale;
     }
-    const Bitmap<T> &self = *this;
-    Bitmap<T> result(rect.height, rect.width, region_offset, scale);
-    const Pixel delta{direction == 0, direction == 1};
-    for (Pixel p : sampling(result)) {
-        result(p) = self(p + rect.tl() + delta) - self(p + rect.tl());
+    constexpr int channels = sizeof(T) / sizeof(float);
+    Bitmap<T> result(std::max(rect.height, 0), std::max(rect.width, 0), region_offset, scale);
+    for (int y=0; y<result.rows; ++y) {
+        const float *row = reinterpret_cast<const float*>(DataType::operator[](rect.y + y) + rect.x);
+        const float *next = (direction == 0) ? row + channels : reinterpret_cast<const float*>(DataType::operator[](rect.y + y + 1) + rect.x);
+        subtract_rows(next, row, reinterpret_cast<float*>(result[y]), result.cols * channels);
     }
     return result;
 }
@@ -165,16 +388,25 @@ Bitmap<T> Bitmap<T>::d(int direction, Region region) const
 template<typename T>
 Bitmap<T> Bitmap<T>::downscale() const
 {
-    /// @todo do some filtering...
-    Bitmap<T> result(DataType::rows / 2, DataType::cols / 2, offset);
-    result.scale = 2 * scale;
-    result.offset += Vector2(scale, scale);
-    result = 0 * T();
-    for (Pixel s : sampling(*this)) {
-        Pixel d(s.x / 2, s.y / 2);
-        if (d.y < result.rows and d.x < result.cols) {
-            result(d) += (*this)(s);
+    constexpr int channels = sizeof(T) / sizeof(float);
+    Bitmap<T> result(DataType::rows / 2, DataType::cols / 2, offset, 2 * scale);
+    if (result.empty()) {
+        return result;
+    }
+    // filter horizontally each source row once, then combine three of these with a vertical filter
+    const int row_size = result.cols * channels;
+    vector<float> buffer(3 * row_size);
+    float *prev = &buffer[0], *mid = prev + row_size, *next = mid + row_size;
+    binomial_decimate<channels>(reinterpret_cast<const float*>(DataType::operator[](0)), next, result.cols);
+    for (int y=0; y<result.rows; ++y) {
+        std::swap(prev, next);
+        if (y == 0) {
+            std::copy(prev, prev + row_size, mid);
+        } else {
+            binomial_decimate<channels>(reinterpret_cast<const float*>(DataType::operator[](2 * y)), mid, result.cols);
         }
+        binomial_decimate<channels>(reinterpret_cast<const float*>(DataType::operator[](2 * y + 1)), next, result.cols);
+        binomial_rows(prev, mid, next, reinterpret_cast<float*>(result[y]), row_size, 1.f / 16);
     }
     return result;
 }
@@ -183,11 +415,10 @@ template<>
 Bitmap<float> Bitmap<Vector3>::grayscale(Rect rect) const
 {
     init_rect(rect, *this);
-    Bitmap1 result(rect, scale);
+    Bitmap1 result(rect.height, rect.width, to_world(rect.tl()), scale);
     const Vector3 coef = {0.114, 0.587, 0.299};
-    for (Pixel p : sampling(result)) {
-        const Vector3 val = (*this)(p + rect.tl());
-        result(p) = val.dot(coef);
+    for (int y=0; y<result.rows; ++y) {
+        grayscale_row(reinterpret_cast<const float*>(DataType::operator[](rect.y + y) + rect.x), result[y], result.cols, coef);
     }
     return result;
 }
@@ -198,6 +429,135 @@ Bitmap<float> Bitmap<Vector3>::grayscale(Region region) const
     return grayscale(to_rect(to_local(region)));
 }
 
+Pyramid::Pyramid(const Bitmap3 &img, int level_count, int derivative_count)
+{
+    levels.reserve(level_count);
+    for (int i=0; i<level_count; ++i) {
+        Level level;
+        level.img = (i == 0) ? img : levels.back().img.downscale();
+        if (derivative_count < 0 or i < derivative_count) {
+            level.dx = level.img.d(0);
+            level.dy = level.img.d(1);
+        }
+        levels.push_back(level);
+    }
+}
+
+const Pyramid::Level& Pyramid::operator [] (int i) const
+{
+    return levels[i];
+}
+
+int Pyramid::size() const
+{
+    return levels.size();
+}
+
+int level_count(float radius, float min_size)
+{
+    int result = 1;
+    for (float size=radius; size > min_size; size /= 2) {
+        result += 1;
+    }
+    return result;
+}
+
+Peak refine_peak(const Bitmap1 &score, Pixel maximum, float low, PeakFit fit)
+{
+    Peak result{score.to_world(maximum), score(maximum), 0};
+    if (score.rows < 3 or score.cols < 3) {
+        return result;
+    }
+    const Pixel origin(clamp(maximum.x, 1, score.cols - 2), clamp(maximum.y, 1, score.rows - 2));
+    const float peak = result.score, floor = std::max(1e-6f * (peak - low), std::numeric_limits<float>::min());
+    float values[3][3];
+    float sum_neighbors = 0;
+    int count_neighbors = 0;
+    bool is_complete = true;
+    for (int y=-1; y<=1; ++y) {
+        const float *row = score[origin.y + y] + origin.x;
+        for (int x=-1; x<=1; ++x) {
+            float s = row[x];
+            if (std::isfinite(s) and (x or y)) {
+                sum_neighbors += s;
+                count_neighbors += 1;
+            }
+            is_complete = is_complete and std::isfinite(s);
+            if (fit == PeakFit::gaussian and std::isfinite(s)) {
+                s = std::log(std::max(s - low, floor));
+            }
+            values[y + 1][x + 1] = s;
+        }
+    }
+    Vector2 offset(0, 0);
+    if (fit == PeakFit::parabolic) {
+        if (std::isfinite(values[1][0] + values[1][1] + values[1][2])) {
+            offset[0] = parabola_offset(values[1][0], values[1][1], values[1][2]);
+        }
+        if (std::isfinite(values[0][1] + values[1][1] + values[2][1])) {
+            offset[1] = parabola_offset(values[0][1], values[1][1], values[2][1]);
+        }
+    } else if (is_complete) {
+        // closed-form least squares on the full neighborhood, the sums of columns and rows decouple the terms
+        float columns[3], rows[3];
+        for (int i=0; i<3; ++i) {
+            columns[i] = values[0][i] + values[1][i] + values[2][i];
+            rows[i] = values[i][0] + values[i][1] + values[i][2];
+        }
+        const float gx = (columns[2] - columns[0]) / 6, gy = (rows[2] - rows[0]) / 6;
+        const float hxx = (columns[0] - 2 * columns[1] + columns[2]) / 3, hyy = (rows[0] - 2 * rows[1] + rows[2]) / 3;
+        const float hxy = (values[0][0] - values[0][2] - values[2][0] + values[2][2]) / 4;
+        offset = quadratic_offset(gx, gy, hxx, hxy, hyy);
+    } else {
+        offset = fit_incomplete(values);
+    }
+    result.position = score.to_world(origin) + offset * score.scale;
+    result.sharpness = (peak > low and count_neighbors > 0) ? clamp((peak - sum_neighbors / count_neighbors) / (peak - low), 0, 1) : 0;
+    return result;
+}
+
+Peak find_peak(const Bitmap1 &score, PeakFit fit)
+{
+    cv::Point origin;
+    double low;
+    cv::minMaxLoc(score, &low, 0, 0, &origin);
+    return refine_peak(score, origin, low, fit);
+}
+
+vector<Peak> find_peaks(const Bitmap1 &score, int count, PeakFit fit)
+{
+    double low;
+    cv::minMaxLoc(score, &low);
+    // bounded heap of the strongest candidates, the weakest one on top
+    using Candidate = std::pair<float, int>;
+    auto is_stronger = [](const Candidate &a, const Candidate &b) { return a.first > b.first or (a.first == b.first and a.second < b.second); };
+    vector<Candidate> heap;
+    heap.reserve(count + 1);
+    for (int y=0; y<score.rows; ++y) {
+        for (int x=0; x<score.cols; ++x) {
+            if (not is_local_maximum(score, x, y)) {
+                continue;
+            }
+            const Candidate candidate(score(y, x), y * score.cols + x);
+            if (int(heap.size()) < count) {
+                heap.push_back(candidate);
+                std::push_heap(heap.begin(), heap.end(), is_stronger);
+            } else if (count > 0 and is_stronger(candidate, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), is_stronger);
+                heap.back() = candidate;
+                std::push_heap(heap.begin(), heap.end(), is_stronger);
+            }
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), is_stronger);
+    vector<Peak> result;
+    result.reserve(heap.size());
+    for (const Candidate &candidate : heap) {
+        result.push_back(refine_peak(score, Pixel(candidate.second % score.cols, candidate.second / score.cols), low, fit));
+    }
+    return result;
+}
+
 template class Bitmap<float>;
 template class Bitmap<Vector2>;
 template class Bitmap<Vector3>;
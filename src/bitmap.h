@@ -41,6 +41,11 @@ struct Bitmap : public cv::Mat_<T>
      */
     T operator () (Vector2) const;
     
+    /** Sample from this bitmap at many positions in world reference frame
+     * Gives the same results as calling operator () on each of them, only faster.
+     */
+    void sample(const Vector2 *positions, int count, T *out) const;
+    
     bool contains(Vector2) const;
     
     bool read(VideoCapture&, bool synchronize=false);
@@ -49,15 +54,33 @@ struct Bitmap : public cv::Mat_<T>
     Bitmap<T> crop(Region) const;
     Bitmap<T> d(int direction, Rect rect=Rect()) const;
     Bitmap<T> d(int direction, Region) const;
+    
+    /** Half-size image, smoothed by a binomial filter
+     * Each result pixel is centered at an even pixel of this bitmap, so the offset stays the same.
+     */
     Bitmap<T> downscale() const;
     Bitmap<float> grayscale(Rect rect=Rect()) const;
     Bitmap<float> grayscale(Region) const;
 };
 
+/** Horizontal run of pixels within one row of a sampling
+ */
+struct Span
+{
+    Pixel start;
+    int count;
+};
+
 struct RectSampling
 {
     Pixel tl;
     Pixel br;
+    int row_count() const {
+        return br.y - tl.y;
+    }
+    Span row(int i) const {
+        return Span{Pixel(tl.x, tl.y + i), br.x - tl.x};
+    }
     struct Iterator : public Pixel {
         int left;
         int right;
@@ -131,6 +154,15 @@ struct TriSampling
     Iterator end() const {
         return Iterator(bottom.y);
     }
+    int row_count() const {
+        return bottom.y - top.y;
+    }
+    Span row(int i) const {
+        Iterator it = begin();
+        it.y += i;
+        int left = it.bound(false);
+        return Span{Pixel(left, it.y), std::max(1, int(std::ceil(it.bound(true))) - left)};
+    }
 };
 
 template<typename T>
@@ -178,5 +210,69 @@ using Bitmap1 = Bitmap<float>;
 using Bitmap2 = Bitmap<Vector2>;
 using Bitmap3 = Bitmap<Vector3>;
 
+/** Sequence of downscaled images, from the original one to the coarsest
+ * Each level may also keep its derivatives so that they are calculated only once.
+ * Copies share the pixel data, just like the OpenCV matrices do.
+ */
+struct Pyramid
+{
+    struct Level
+    {
+        Bitmap3 img;
+        Bitmap3 dx, dy;
+    };
+    vector<Level> levels;
+    
+    Pyramid() = default;
+    /** @param derivative_count Number of the finest levels that keep their derivatives, negative for all of them
+     */
+    Pyramid(const Bitmap3&, int level_count, int derivative_count=-1);
+    const Level& operator [] (int) const;
+    int size() const;
+};
+
+/** Pyramid of a view image, built once per frame and then shared by all trackers
+ * It is only as deep as the trackers need, and derivatives are only kept on the levels that the forward solvers read.
+ */
+using FramePyramid = Pyramid;
+
+/** Number of pyramid levels used for fitting a region of given radius
+ * Each level halves the size, until it is no more than min_size
+ */
+int level_count(float radius, float min_size);
+
+/** Method of interpolating a maximum between pixels
+ */
+enum class PeakFit
+{
+    parabolic, ///< Independent parabola along each axis
+    quadratic, ///< Quadratic polynomial of both coordinates, least squares on the 3x3 neighborhood
+    gaussian ///< Quadratic polynomial fitted to the logarithm of the score, above its minimum
+};
+
+/** Local maximum of a score bitmap
+ */
+struct Peak
+{
+    Vector2 position; ///< Subpixel location in world coordinates
+    float score;
+    float sharpness; ///< Drop from the maximum to its 3x3 neighborhood, relative to the range of the score, from 0 to 1
+};
+
+/** Refine a pixel-precise maximum of the score
+ * Non-finite neighbors are left out of the fit. No memory is allocated.
+ * @param low Minimum of the score, so that the sharpness and the Gaussian fit are relative to it
+ */
+Peak refine_peak(const Bitmap1 &score, Pixel maximum, float low, PeakFit fit=PeakFit::quadratic);
+
+/** Global maximum of the score with subpixel precision
+ */
+Peak find_peak(const Bitmap1 &score, PeakFit fit=PeakFit::quadratic);
+
+/** Strongest local maxima of the score, in descending order
+ * This is useful for keeping several hypotheses, the first result is the same as from find_peak.
+ */
+vector<Peak> find_peaks(const Bitmap1 &score, int count, PeakFit fit=PeakFit::quadratic);
+
 
 #endif
@@ -1,5 +1,6 @@
 #include "children_grid.h"
 #include "optimization.h"
+#include <numeric>
 
 #if defined TRANSFORMATION_PERSPECTIVE_H
 const std::array<int, 4> centerpoint_index = {2, 3, 1, 0};
@@ -7,7 +8,10 @@ const std::array<int, 4> centerpoint_index = {2, 3, 1, 0};
 const std::array<int, 6> centerpoint_index = {0, 0, 0, 0, 0, 0};
 #endif
 
-Children::Children(const Bitmap3 &image, Region parent):
+/// Size of the coarsest pyramid level, the whole grid is fitted at once
+const int min_size = 10;
+
+Children::Children(const Pyramid &image, Region parent):
     ref(image),
     parent_region(parent)
 {
@@ -34,35 +38,33 @@ Children::Children(const Bitmap3 &image, Region parent):
 #endif
 }
 
-void Children::refit(const Bitmap3 &img, const Transformation &parent_tsf)
+void Children::refit(const FramePyramid &view, const Transformation &parent_tsf)
 {
     const int iteration_count = 2;
-    const int min_size = 10;
     for (Transformation &tsf : children) {
         tsf = parent_tsf;
     }
-    vector<std::pair<Bitmap3, Bitmap3>> pyramid = {{img, ref}};
-    for (float size=radius(parent_tsf.region); size > min_size; size /= 2) {
-        auto &pair = pyramid.back();
-        pyramid.emplace_back(pair.first.downscale(), pair.second.downscale());
-    }
-    std::reverse(pyramid.begin(), pyramid.end());
-    for (const auto &pair : pyramid) {
-        Bitmap3 dx = pair.first.d(0), dy = pair.first.d(1);
+    const int count = level_count(radius(parent_tsf.region), min_size);
+    assert(count <= view.size() and count <= ref.size());
+    for (int level=count - 1; level >= 0; --level) {
+        const Bitmap3 &img = view[level].img, &dx = view[level].dx, &dy = view[level].dy, &reference = ref[level].img;
         vector<float> prev_energy;
-        std::transform(children.begin(), children.end(), std::back_inserter(prev_energy), [pair](const Transformation &tsf) { return evaluate(tsf, pair.first, pair.second); });
+        std::transform(children.begin(), children.end(), std::back_inserter(prev_energy), [&img, &reference](const Transformation &tsf) { return evaluate(tsf, img, reference); });
         for (int iteration=0; iteration < iteration_count; ++iteration) {
-            Vector2 delta_center;
+            // children are fitted in parallel, their contributions are then added in a fixed order
+            vector<Vector2> child_deltas(children.size());
+            #pragma omp parallel for schedule(dynamic)
             for (int i=0; i<children.size(); ++i) {
                 const Transformation &tsf = children[i];
-                Transformation::Params delta_tsf = update_step(tsf, pair.first, dx, pair.second, 0) + update_step(tsf, pair.first, dy, pair.second, 1);
+                Transformation::Params delta_tsf = update_step(tsf, img, dx, dy, reference);
                 float step_mag = 2 * step_length(delta_tsf, tsf);
                 if (step_mag < 1e-10) {
-                    break;
+                    continue;
                 }
-                float length = line_search(delta_tsf, prev_energy[i], pair.first.scale / step_mag, tsf, pair.first, pair.second);
-                delta_center += length * extract_point(delta_tsf, centerpoint_index[i]);
+                float length = line_search(delta_tsf, prev_energy[i], img.scale / step_mag, tsf, img, reference);
+                child_deltas[i] = length * extract_point(delta_tsf, centerpoint_index[i]);
             }
+            Vector2 delta_center = std::accumulate(child_deltas.begin(), child_deltas.end(), Vector2());
             for (int i=0; i<children.size(); ++i) {
                 children[i].increment(delta_center, centerpoint_index[i]);
             }
@@ -70,6 +72,11 @@ void Children::refit(const Bitmap3 &img, const Transformation &parent_tsf)
     }
 }
 
+int Children::depth() const
+{
+    return level_count(radius(parent_region), min_size);
+}
+
 Vector2 Children::operator()(const Transformation &parent_tsf) const
 {
     Vector2 center = extract_point(children.front(), centerpoint_index.front());
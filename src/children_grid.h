@@ -6,12 +6,16 @@ struct Transformation;
 
 struct Children
 {
-    Children(const Bitmap3&, Region parent);
-    void refit(const Bitmap3&, const Transformation&);
+    Children(const Pyramid&, Region parent);
+    void refit(const FramePyramid&, const Transformation&);
+    
+    /** Number of view pyramid levels read by refit, all of them with derivatives
+     */
+    int depth() const;
     Vector2 operator() (const Transformation&) const;
     vector<Transformation> children;
 protected:
-    Bitmap3 ref;
+    Pyramid ref;
     Region parent_region;
 };
 #endif
@@ -2,7 +2,10 @@
 #include "children_markers.h"
 #include "optimization.h"
 
-Children::Children(const Bitmap3 &image, Region parent):
+/// Size of the coarsest pyramid level for fitting each marker
+const int min_size = 3;
+
+Children::Children(const Pyramid &image, Region parent):
     ref(image)
 {
     float scale = parent.height;
@@ -12,12 +15,21 @@ Children::Children(const Bitmap3 &image, Region parent):
     children.emplace_back(upper);
 }
 
-void Children::refit(const Bitmap3 &img, const Transformation &parent_tsf)
+void Children::refit(const FramePyramid &view, const Transformation &parent_tsf)
 {
     for (Transformation &tsf : children) {
         tsf = parent_tsf;
-        refit_transformation(tsf, img, ref);
+        refit_transformation(tsf, view, ref, min_size);
+    }
+}
+
+int Children::depth() const
+{
+    int result = 0;
+    for (const Transformation &tsf : children) {
+        result = std::max(result, level_count(radius(tsf.region), min_size));
     }
+    return result;
 }
 
 Vector2 Children::operator()(const Transformation &parent_tsf) const
@@ -1,45 +1,15 @@
 #include "eye.h"
 #include <iostream>
+#if defined __AVX__
+#include <immintrin.h>
+#elif defined __SSE__
+#include <xmmintrin.h>
+#endif
 
 using Curve = std::vector<Pixel>;
 
 namespace {
 
-/** Get quadratic-interpolated maximum location in world coordinates
- */
-Vector2 precise_maximum(Bitmap1 score)
-{
-	cv::Point origin;
-	cv::minMaxLoc(score, 0, 0, 0, &origin);
-	origin.x = clamp(origin.x, 1, score.cols - 2);
-	origin.y = clamp(origin.y, 1, score.rows - 2);
-	Matrix system, rhs;
-	for (int x=-1; x<=1; ++x) {
-		for (int y=-1; y<=1; ++y) {
-            float s = score(Pixel(x, y) + origin);
-            if (std::isfinite(s)) {
-                Matrix tmp(1, 6);
-                tmp(0) = x*x;
-                tmp(1) = x*y;
-                tmp(2) = x;
-                tmp(3) = y*y;
-                tmp(4) = y;
-                tmp(5) = 1;
-                system.push_back(tmp);
-                rhs.push_back(s);
-            }
-		}
-	}
-	Matrix v;
-	cv::solve(system, rhs, v, cv::DECOMP_SVD);
-	Matrix polynomial(3, 3);
-	polynomial << 2*v(0), v(1), v(2), v(1), 2*v(3), v(4), v(2), v(4), 2*v(5);
-	Matrix result;
-	cv::solve(polynomial.colRange(0, 2).rowRange(0, 2), polynomial.rowRange(0, 2).col(2), result);
-    Vector2 offset(clamp(result(0), -1, 1), clamp(result(1), -1, 1));
-    return score.to_world(origin) - offset;
-}
-
 Curve make_circle(int r)
 {
 	Curve result;
@@ -59,13 +29,178 @@ Curve make_circle(int r)
 	return result;
 }
 
+/** Approximate medoid of a set of colors in linear time
+ * Picks the color that is closest to the channel-wise median.
+ */
+Vector3 approximate_medoid(vector<Vector3> &colors)
+{
+    Vector3 median;
+    auto mid = colors.begin() + colors.size() / 2;
+    for (int channel=0; channel<3; ++channel) {
+        std::nth_element(colors.begin(), mid, colors.end(), [channel](Vector3 l, Vector3 r) {
+            return l[channel] < r[channel];
+        });
+        median[channel] = (*mid)[channel];
+    }
+    return *std::min_element(colors.begin(), colors.end(), [median](Vector3 l, Vector3 r) {
+        return (l - median).dot(l - median) < (r - median).dot(r - median);
+    });
+}
+
 void error_message(Circle c)
 {
     printf(" empty bitmap around eye (%g, %g)\n", c.center[0], c.center[1]);
 }
 
+/** Call fn(pixel, offcenter, weight) on each pixel closer than 1 to the circle, weighted by 1 - that distance
+ * Only the arcs of the ring are scanned on each row, so it takes O(radius) time.
+ */
+template<typename Function>
+void for_ring(const Bitmap1 &img, Circle c, Function fn)
+{
+    const Vector2 center = img.to_local(c.center);
+    const float inner = (c.radius - 1) / img.scale, outer = (c.radius + 1) / img.scale;
+    auto scan = [&img, c, &fn](int y, float left, float right) {
+        for (int x = std::max<int>(std::ceil(left), 0); x <= std::min<int>(std::floor(right), img.cols - 1); ++x) {
+            Vector2 offcenter = img.to_world(Pixel(x, y)) - c.center;
+            float w = 1 - std::abs(std::sqrt(offcenter.dot(offcenter)) - c.radius);
+            if (w > 0) {
+                fn(Pixel(x, y), offcenter, w);
+            }
+        }
+    };
+    const int top = std::max<int>(std::ceil(center[1] - outer), 0), bottom = std::min<int>(std::floor(center[1] + outer), img.rows - 1);
+    for (int y=top; y<=bottom; ++y) {
+        const float dy2 = pow2(y - center[1]);
+        const float outer_width = std::sqrt(std::max(0.f, pow2(outer) - dy2));
+        if (inner > 0 and pow2(inner) > dy2) {
+            const float inner_width = std::sqrt(pow2(inner) - dy2);
+            scan(y, center[0] - outer_width, center[0] - inner_width);
+            scan(y, center[0] + inner_width, center[0] + outer_width);
+        } else {
+            scan(y, center[0] - outer_width, center[0] + outer_width);
+        }
+    }
+}
+
+/** Central difference gradient of a row, split into its unit direction and magnitude
+ * The gradient is (right - left, below - above) / 2, the direction is zero where it vanishes.
+ */
+void gradient_direction_row(const float *left, const float *right, const float *above, const float *below, float *out_x, float *out_y, float *out_magnitude, int count)
+{
+    int i = 0;
+#if defined __AVX__
+    const __m256 half8 = _mm256_set1_ps(0.5f), tiny8 = _mm256_set1_ps(1e-20f);
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_mul_ps(half8, _mm256_sub_ps(_mm256_loadu_ps(right + i), _mm256_loadu_ps(left + i)));
+        __m256 y = _mm256_mul_ps(half8, _mm256_sub_ps(_mm256_loadu_ps(below + i), _mm256_loadu_ps(above + i)));
+        __m256 magnitude = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)));
+        __m256 divisor = _mm256_max_ps(magnitude, tiny8);
+        _mm256_storeu_ps(out_x + i, _mm256_div_ps(x, divisor));
+        _mm256_storeu_ps(out_y + i, _mm256_div_ps(y, divisor));
+        _mm256_storeu_ps(out_magnitude + i, magnitude);
+    }
+#endif
+#if defined __SSE__
+    const __m128 half4 = _mm_set1_ps(0.5f), tiny4 = _mm_set1_ps(1e-20f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_mul_ps(half4, _mm_sub_ps(_mm_loadu_ps(right + i), _mm_loadu_ps(left + i)));
+        __m128 y = _mm_mul_ps(half4, _mm_sub_ps(_mm_loadu_ps(below + i), _mm_loadu_ps(above + i)));
+        __m128 magnitude = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)));
+        __m128 divisor = _mm_max_ps(magnitude, tiny4);
+        _mm_storeu_ps(out_x + i, _mm_div_ps(x, divisor));
+        _mm_storeu_ps(out_y + i, _mm_div_ps(y, divisor));
+        _mm_storeu_ps(out_magnitude + i, magnitude);
+    }
+#endif
+    for (; i < count; ++i) {
+        float x = 0.5f * (right[i] - left[i]), y = 0.5f * (below[i] - above[i]);
+        float magnitude = std::sqrt(x * x + y * y), divisor = std::max(magnitude, 1e-20f);
+        out_x[i] = x / divisor;
+        out_y[i] = y / divisor;
+        out_magnitude[i] = magnitude;
+    }
+}
+
+/// Unlike Bitmap::crop, gives an empty bitmap if the region is outside
+Bitmap3 crop_frame(const Bitmap3 &frame, Region region)
+{
+    Rect rect = to_rect(frame.to_local(region)) & Rect(Pixel(0, 0), frame.size());
+    return rect.area() ? frame.crop(region) : Bitmap3();
+}
+
 } // end anonymous namespace
 
+EyeFeatures::EyeFeatures(const Bitmap3 &frame, Circle eye, float neighborhood, float min_margin) :
+    img(crop_frame(frame, to_region(Circle{eye.center, std::max(neighborhood * eye.radius, eye.radius + min_margin)})))
+{
+}
+
+const Bitmap1& EyeFeatures::gray() const
+{
+    std::call_once(gray_flag, [this]() {
+        gray_img = img.grayscale();
+    });
+    return gray_img;
+}
+
+const Bitmap1& EyeFeatures::dx() const
+{
+    std::call_once(gradient_flag, [this]() {
+        if (gray().rows > 1 and gray().cols > 1) {
+            dx_img = gray().d(0);
+            dy_img = gray().d(1);
+        }
+    });
+    return dx_img;
+}
+
+const Bitmap1& EyeFeatures::dy() const
+{
+    dx();
+    return dy_img;
+}
+
+const Bitmap1& EyeFeatures::dxx() const
+{
+    std::call_once(hessian_flag, [this]() {
+        if (dx().cols > 1 and dy().rows > 1) {
+            dxx_img = dx().d(0);
+            dxy_img = dx().d(1);
+            dyy_img = dy().d(1);
+        }
+    });
+    return dxx_img;
+}
+
+const Bitmap1& EyeFeatures::dxy() const
+{
+    dxx();
+    return dxy_img;
+}
+
+const Bitmap1& EyeFeatures::dyy() const
+{
+    dxx();
+    return dyy_img;
+}
+
+const Bitmap3& EyeFeatures::hsv() const
+{
+    std::call_once(hsv_flag, [this]() {
+        hsv_img = Bitmap3(img.rows, img.cols, img.offset, img.scale);
+        if (not img.empty()) {
+            cv::cvtColor(img, hsv_img, cv::COLOR_BGR2HSV);
+        }
+    });
+    return hsv_img;
+}
+
+float FindEye::refit(Circle &c, const Bitmap3 &img) const
+{
+    return refit(c, EyeFeatures(img, c));
+}
+
 void ParallelEye::add(FindEyePtr&& child)
 {
     children.emplace_back(std::move(child));
@@ -80,11 +215,12 @@ int subset_size(int mask)
     return result;
 }
 
-Vector2 subset_mean(const vector<Vector2> &points, int mask)
+template<typename T>
+T subset_mean(const vector<T> &points, int mask)
 {
-    Vector2 sum;
-    for (int i = 1; i <= mask; i <<= 1) {
-        if (i & mask) {
+    T sum = T();
+    for (int i = 0; (1 << i) <= mask; ++i) {
+        if ((1 << i) & mask) {
             sum += points[i];
         }
     }
@@ -94,30 +230,31 @@ Vector2 subset_mean(const vector<Vector2> &points, int mask)
 float subset_variance(const vector<Vector2> &points, int mask)
 {
     Vector2 mean = subset_mean(points, mask);
-    float variance;
-    for (int i = 1; i <= mask; i <<= 1) {
-        if (i & mask) {
+    float variance = 0;
+    for (int i = 0; (1 << i) <= mask; ++i) {
+        if ((1 << i) & mask) {
             variance += cv::norm(points[i] - mean, cv::NORM_L2SQR);
         }
     }
     return variance / (subset_size(mask) - 1);
 }
 
-void ParallelEye::refit(Circle &circle, const Bitmap3 &img) const
+float ParallelEye::refit(Circle &circle, const EyeFeatures &features) const
 {
     if (children.empty()) {
-        return;
+        return 0;
     } else if (children.size() == 1) {
-        children.front()->refit(circle, img);
-        return;
+        return children.front()->refit(circle, features);
     }
-    vector<Vector2> votes;
-    for (const auto &child : children) {
+    vector<Vector2> votes(children.size());
+    vector<float> confidences(children.size());
+    #pragma omp parallel for schedule(dynamic) if (is_concurrent)
+    for (int i=0; i<children.size(); ++i) {
         Circle copy = circle;
-        child->refit(copy, img);
-        votes.push_back(copy.center);
+        confidences[i] = children[i]->refit(copy, features);
+        votes[i] = copy.center;
     }
-    float best_variance = HUGE_VALF;
+    float best_variance = HUGE_VALF, result = 0;
     for (int i=0; i < (1 << votes.size()); ++i) {
         if (subset_size(i) < 2) {
             continue;
@@ -126,8 +263,11 @@ void ParallelEye::refit(Circle &circle, const Bitmap3 &img) const
         if (var < best_variance) {
             circle.center = subset_mean(votes, i);
             best_variance = var;
+            // the agreeing children vouch for the result, the more of them and the closer together the better
+            result = subset_mean(confidences, i) * subset_size(i) / votes.size() / (1 + var / pow2(circle.radius));
         }
     }
+    return result;
 }
 
 void SerialEye::add(FindEyePtr&& child)
@@ -135,11 +275,37 @@ void SerialEye::add(FindEyePtr&& child)
     children.emplace_back(std::move(child));
 }
 
-void SerialEye::refit(Circle &c, const Bitmap3 &img) const
+float SerialEye::refit(Circle &c, const EyeFeatures &features) const
 {
+    float result = 0;
     for (const auto &child : children) {
-        child->refit(c, img);
+        result = child->refit(c, features);
     }
+    return result;
+}
+
+void CascadeEye::add(FindEyePtr&& stage, float sufficient_confidence)
+{
+    stages.emplace_back(std::move(stage), sufficient_confidence);
+}
+
+float CascadeEye::refit(Circle &c, const EyeFeatures &features) const
+{
+    // each stage starts afresh, a rejected result is not a good starting point for the next one
+    const Circle start = c;
+    float best_confidence = -1;
+    for (const auto &stage : stages) {
+        Circle candidate = start;
+        const float confidence = stage.first->refit(candidate, features);
+        if (confidence >= stage.second) {
+            c = candidate;
+            return confidence;
+        } else if (confidence > best_confidence) {
+            c = candidate;
+            best_confidence = confidence;
+        }
+    }
+    return std::max(best_confidence, 0.f);
 }
 
 inline void cast_vote(Bitmap1 &img, Vector2 v, float weight)
@@ -163,24 +329,20 @@ bool HoughEye::hsv_bounded(Vector3 hsv) const
     return h >= hl and h <= hh and s >= sl and s <= sh and v >= vl and v <= vh;
 }
 
-void HoughEye::refit(Circle &c, const Bitmap3 &img) const
+float HoughEye::refit(Circle &c, const EyeFeatures &features) const
 {
     const float max_distance = 2 * c.radius;
     const Vector2 span(max_distance, max_distance);
     Region region(c.center - span, c.center + span);
     Bitmap1 votes(to_rect(region));
     votes = 0;
-    Bitmap1 gray = img.grayscale(region);
-    if (not gray.rows or not gray.cols) {
+    if (features.gray().empty()) {
         error_message(c);
-        return;
+        return 0;
     }
     bool use_hsv_mask = (hsv_low != Vector3(0, 0, 0) or hsv_high != Vector3(1, 1, 1));
-    Bitmap3 hsv;
-    if (use_hsv_mask) {
-        cv::cvtColor(img, hsv, cv::COLOR_BGR2HSV);
-    }
-    Bitmap1 dx = gray.d(0), dy = gray.d(1);
+    const Bitmap3 &hsv = use_hsv_mask ? features.hsv() : features.img;  // read only with the mask
+    Bitmap1 dx = features.dx().crop(region), dy = features.dy().crop(region);
     for (Pixel p : sampling(dx)) {
         Vector2 v = dx.to_world(p);
         if (use_hsv_mask and hsv_bounded(hsv(v))) {
@@ -199,61 +361,159 @@ void HoughEye::refit(Circle &c, const Bitmap3 &img) const
         float size = cv::norm(gradient);
         cast_vote(votes, v - gradient * c.radius / size, size);
     }
-    Pixel result;
-    c.center = precise_maximum(votes);
+    const Peak peak = find_peak(votes);
+    c.center = peak.position;
+    return peak.sharpness;
 }
 
-void LimbusEye::refit(Circle &c, const Bitmap3 &img) const
+float MultiHoughEye::refit(Circle &c, const EyeFeatures &features) const
+{
+    const Vector2 span = Vector2(1, 1) * (1 + max_scale) * c.radius;
+    const Bitmap1 gray = features.gray().crop(Region(c.center - span, c.center + span));
+    if (gray.rows < 3 or gray.cols < 3) {
+        error_message(c);
+        return 0;
+    }
+    const int rows = gray.rows, cols = gray.cols, count = cols - 2;
+    vector<float> radii(radius_count);
+    for (int k=0; k<radius_count; ++k) {
+        radii[k] = c.radius * ((radius_count > 1) ? min_scale + k * (max_scale - min_scale) / (radius_count - 1) : 1);
+    }
+    // accumulators for all radii are stacked in one bitmap, on the same grid as the gray image
+    Bitmap1 votes(radius_count * rows, cols);
+    votes = 0;
+    vector<float> direction_x(count), direction_y(count), magnitude(count);
+    for (int y=1; y<rows - 1; ++y) {
+        const float *row = gray[y];
+        gradient_direction_row(row, row + 2, gray[y - 1] + 1, gray[y + 1] + 1, direction_x.data(), direction_y.data(), magnitude.data(), count);
+        for (int i=0; i<count; ++i) {
+            if (magnitude[i] == 0) {
+                continue;
+            }
+            // the iris is darker than its surroundings, so the center lies against the gradient
+            for (int k=0; k<radius_count; ++k) {
+                const float distance = radii[k] / gray.scale;
+                const float pos_x = i + 1 - distance * direction_x[i], pos_y = y - distance * direction_y[i];
+                const int left = pos_x, top = pos_y;
+                if (pos_x < 0 or left + 1 >= cols or pos_y < 0 or top + 1 >= rows) {
+                    continue;
+                }
+                float *upper = votes[k * rows + top], *lower = votes[k * rows + top + 1];
+                const float weight = magnitude[i], lr = pos_x - left, tb = pos_y - top;
+                upper[left] += weight * (1 - lr) * (1 - tb);
+                upper[left + 1] += weight * lr * (1 - tb);
+                lower[left] += weight * (1 - lr) * tb;
+                lower[left + 1] += weight * lr * tb;
+            }
+        }
+    }
+    Pixel peak;
+    double low;
+    cv::minMaxLoc(votes, &low, 0, 0, &peak);
+    const int layer = peak.y / rows;
+    peak.y -= layer * rows;
+    const Peak refined = refine_peak(Bitmap1(votes.rowRange(layer * rows, (layer + 1) * rows), gray.offset, gray.scale), peak, low);
+    c.center = refined.position;
+    // quadratic interpolation of the radius between neighboring layers
+    if (layer > 0 and layer + 1 < radius_count) {
+        const float prev = votes(layer * rows - rows + peak.y, peak.x), mid = votes(layer * rows + peak.y, peak.x), next = votes(layer * rows + rows + peak.y, peak.x);
+        const float curvature = prev - 2 * mid + next;
+        const float offset = (curvature < 0) ? clamp(0.5 * (prev - next) / curvature, -0.5, 0.5) : 0;
+        c.radius = radii[layer] + offset * (radii[1] - radii[0]);
+    } else {
+        c.radius = radii[layer];
+    }
+    return refined.sharpness;
+}
+
+float LimbusEye::refit(Circle &c, const EyeFeatures &features) const
 {
     constexpr int iteration_count = 5;
+    // together with the width of the ring and the pixels lost by second derivatives, this fits within the margin of EyeFeatures
     const Vector2 margin = Vector2(1, 1) * (iteration_count + c.radius);
     Region bounds(c.center - margin, c.center + margin);
-    Bitmap1 gray = img.grayscale(bounds);
-    if (not gray.rows or not gray.cols) {
+    if (features.gray().empty()) {
         error_message(c);
-        return;
+        return 0;
     }
-    Bitmap1 dxx = gray.d(0).d(0), dxy = gray.d(0).d(1), dyy = gray.d(1).d(1);
+    Bitmap1 dxx = features.dxx().crop(bounds), dxy = features.dxy().crop(bounds), dyy = features.dyy().crop(bounds);
     for (int iteration=0; iteration < iteration_count; iteration++) {
         float weight = (2 * iteration < iteration_count) ? 1 : 1.f / (1 << (iteration / 2 - iteration_count / 4));
-        Vector2 delta_pos = {dp(c, 0, dxx) + dp(c, 1, dxy), dp(c, 0, dxy) + dp(c, 1, dyy)};
+        Vector2 delta_pos = gradient(c, dxx, dxy, dyy);
         float length = std::max({std::abs(delta_pos(0)), std::abs(delta_pos(1)), 1e-5f});
         float step = (max_distance / (1 << iteration)) / length;
         c.center += step * delta_pos;
     }
+    return energy(c, features.dx(), features.dy());
 }
 
-float LimbusEye::dp(Circle c, int direction, const Bitmap1 &derivative) const
+Vector2 LimbusEye::gradient(Circle c, const Bitmap1 &dxx, const Bitmap1 &dxy, const Bitmap1 &dyy) const
 {
-    float result = 0;
-    float sum_weight = 0;
-    for (Pixel p : sampling(derivative)) {
-        Vector2 offcenter = derivative.to_world(p) - c.center;
-        float w = 1 - std::abs(cv::norm(offcenter) - c.radius);
-        if (w > 0) {
-            result += w * (derivative(p) * offcenter(direction)) / c.radius;
+    // each derivative lies on its own grid, so each has its own weights
+    auto weighted_mean = [c](const Bitmap1 &derivative) {
+        Vector2 sum(0, 0);
+        float sum_weight = 0;
+        for_ring(derivative, c, [&](Pixel p, Vector2 offcenter, float w) {
+            sum += w * derivative(p) * offcenter;
             sum_weight += w;
-        }
-    }
-    return sum_weight > 0 ? result / sum_weight : 0;
+        });
+        return (sum_weight > 0) ? Vector2(sum / (sum_weight * c.radius)) : Vector2(0, 0);
+    };
+    const Vector2 xx = weighted_mean(dxx), xy = weighted_mean(dxy), yy = weighted_mean(dyy);
+    return {xx[0] + xy[1], xy[0] + yy[1]};
 }
 
-void CorrelationEye::refit(Circle &c, const Bitmap3 &img) const
+float LimbusEye::energy(Circle c, const Bitmap1 &dx, const Bitmap1 &dy) const
 {
-    Bitmap1 gray = img.grayscale(to_region(2 * scale * c));
+    float outward = 0, magnitude = 0;
+    for_ring(dx, c, [&](Pixel p, Vector2 offcenter, float w) {
+        Vector2 gradient(dx(p), dy(c.center + offcenter));
+        outward += w * gradient.dot(offcenter) / std::sqrt(offcenter.dot(offcenter));
+        magnitude += w * cv::norm(gradient);
+    });
+    return magnitude > 0 ? std::max(0.f, outward / magnitude) : 0;
+}
+
+float CorrelationEye::refit(Circle &c, const EyeFeatures &features) const
+{
+    Bitmap1 gray = features.gray().crop(to_region(2 * scale * c));
     if (not gray.rows or not gray.cols) {
         error_message(c);
-        return;
+        return 0;
     }
-    const Vector2 offset = Vector2(scale, scale) * c.radius;
-	Matrix templ = Matrix::ones(2 * offset(1) + 1, 2 * offset(0) + 1);
-    if (gray.rows < templ.rows or gray.cols < templ.cols) {
-        return;
+    const int half = scale * c.radius, size = 2 * half + 1;
+    if (gray.rows < size + 2 or gray.cols < size + 2) {
+        return 0;
+    }
+    // the dark disk covers a span of each row around the center
+    const int disk_rows = std::min<int>(c.radius, half);
+    vector<int> disk_spans;
+    int disk_count = 0;
+    for (int y=-disk_rows; y<=disk_rows; ++y) {
+        disk_spans.push_back(std::min<int>(std::sqrt(pow2(c.radius) - pow2(y)), half));
+        disk_count += 2 * disk_spans.back() + 1;
     }
-	cv::circle(templ, to_pixel(offset), c.radius, 0.0, -1);
-    Bitmap1 score = gray.crop(to_region(scale * c)).clone();
-	cv::matchTemplate(gray, templ, score, cv::TM_CCORR_NORMED);
-	c.center = precise_maximum(score);
+    const double templ_norm = std::sqrt(pow2(size) - disk_count);
+    cv::Mat_<double> sum, sqsum;
+    cv::integral(gray, sum, sqsum, CV_64F, CV_64F);
+    auto rect_sum = [](const cv::Mat_<double> &integral, int top, int left, int bottom, int right) {
+        return integral(bottom, right) - integral(top, right) - integral(bottom, left) + integral(top, left);
+    };
+    // same as cv::matchTemplate with cv::TM_CCORR_NORMED
+    Bitmap1 score(gray.rows - size + 1, gray.cols - size + 1, gray.to_world(Pixel(half, half)), gray.scale);
+    for (Pixel p : sampling(score)) {
+        double window = rect_sum(sum, p.y, p.x, p.y + size, p.x + size);
+        double energy = rect_sum(sqsum, p.y, p.x, p.y + size, p.x + size);
+        double disk = 0;
+        for (int i=0; i<disk_spans.size(); ++i) {
+            const int y = p.y + half - disk_rows + i, x = p.x + half, w = disk_spans[i];
+            disk += rect_sum(sum, y, x - w, y + 1, x + w + 1);
+        }
+        score(p) = (energy > 0) ? (window - disk) / (std::sqrt(energy) * templ_norm) : 0;
+    }
+	const Peak peak = find_peak(score);
+	c.center = peak.position;
+	return peak.sharpness;
 }
 
 BitmapEye::BitmapEye(const string filename, float radius_scale, float neighborhood):
@@ -262,50 +522,56 @@ BitmapEye::BitmapEye(const string filename, float radius_scale, float neighborho
 {
     cv::Mat tmp = cv::imread(filename, cv::IMREAD_UNCHANGED);
     tmp.convertTo(tmp, CV_32F, 1./255);
-    cv::split(tmp, templ);
-    assert(templ.size() >= 3);
+    vector<cv::Mat> channels;
+    cv::split(tmp, channels);
+    assert(channels.size() >= 3);
+    if (channels.size() > 3) {
+        templ_mask = channels[3];
+    }
+    channels.resize(3);
+    cv::merge(channels, templ);
 }
 
-void BitmapEye::refit(Circle &c, const Bitmap3 &img) const
+const BitmapEye::Resized& BitmapEye::resize(int radius) const
 {
-    Bitmap3 square = img.crop(to_region(scale * c));
-    int radius = c.radius / radius_scale;
-    cv::Size size(2 * radius + 1, 2 * radius + 1);
-    if (square.rows < size.height or square.cols < size.width) {
-        return;
+    std::lock_guard<std::mutex> lock(resized_mutex);
+    auto it = resized.find(radius);
+    if (it == resized.end()) {
+        const cv::Size size(2 * radius + 1, 2 * radius + 1);
+        Resized result;
+        cv::resize(templ, result.templ, size);
+        if (not templ_mask.empty()) {
+            cv::resize(templ_mask, result.mask, size);
+        }
+        it = resized.emplace(radius, result).first;
     }
-    /// @todo these calculations work only when img.scale == 1
-    Bitmap1 score(square.rows - size.height + 1, square.cols - size.width + 1, c.center - to_vector(size / 2));
-    vector<Matrix> square_channels;
-    cv::split(square, square_channels);
-    Matrix mask;
-    if (templ.size() > 3) {
-        cv::resize(templ[3], mask, size);
-    }
-	for (int i=0; i<3; ++i) {
-        Matrix score_channel, templ_channel;
-        cv::resize(templ[i], templ_channel, size);
-        matchTemplate(square_channels[i], templ_channel, score_channel, cv::TM_CCORR_NORMED, mask);
-        score += score_channel;
-    }
-    Pixel pmax;
-	cv::minMaxLoc(score, 0, 0, 0, &pmax);
-    Vector2 discrete = score.to_world(pmax);
-    Vector2 interp = precise_maximum(score);
-    if (std::abs(discrete[0] - interp[0]) + std::abs(discrete[1] - interp[1]) < 2) {
-        c.center = interp;
-    } else {
-        c.center = discrete;
+    return it->second;
+}
+
+float BitmapEye::refit(Circle &c, const EyeFeatures &features) const
+{
+    Bitmap3 square = features.img.crop(to_region(scale * c));
+    /// @todo the template radius is in pixels, this works only when img.scale == 1
+    const int radius = c.radius / radius_scale, size = 2 * radius + 1;
+    if (square.rows < size or square.cols < size) {
+        return 0;
     }
+    const Resized &current = resize(radius);
+    // all color channels are correlated at once
+    Bitmap1 score(square.rows - size + 1, square.cols - size + 1, square.to_world(Pixel(radius, radius)), square.scale);
+    cv::matchTemplate(square, current.templ, score, cv::TM_CCORR_NORMED, current.mask);
+    const Peak peak = find_peak(score);
+    c.center = peak.position;
+    return peak.sharpness;
 }
 
 /// cheap (and shifted) approximation to atan2
 int RadialEye::angle_address(Vector2 v, int bin_count)
 {
     float x = v[0], y = v[1];
-    float angle = (std::abs(x) >= std::abs(y)) ? (y / x + (x > 0) ? 1 : 5) : (-x / y + (y > 0) ? 3 : 7);
-    assert (angle >= 0 and angle < 8);
-	return angle * bin_count / 8;
+    float angle = (std::abs(x) >= std::abs(y)) ? (y / x + ((x > 0) ? 1 : 5)) : (-x / y + ((y > 0) ? 3 : 7));
+    assert (angle >= 0 and angle <= 8);
+	return std::min<int>(angle * bin_count / 8, bin_count - 1);
 }
 
 float RadialEye::grad_func(Vector2 grad, Vector2 direction)
@@ -318,73 +584,87 @@ float RadialEye::grad_func(Vector2 grad, Vector2 direction)
 	return (d > 0) ? pow2(pow2(d)) * n : 0;
 }
 
-vector<Vector3> RadialEye::radial_mean(Circle c, const Bitmap3 &img) const
+RadialEye::PolarTable::PolarTable(float radius, float scale) :
+    angular_bins(2 * radius * M_PI),
+    radius(radius)
 {
-    vector<vector<Vector3>> histogram(c.radius + 1);
-    for (Pixel p : sampling(img)) {
-        Vector2 diff = img.to_world(p) - c.center;
-        int r = cv::norm(diff);
-        if (r < c.radius) {
-            histogram[r].push_back(img(p));
+    const int extent = (radius + 1) / scale;
+    vector<vector<Pixel>> histogram(int(radius) + 1);
+    for (int y=-extent; y<=extent; ++y) {
+        for (int x=-extent; x<=extent; ++x) {
+            int r = cv::norm(scale * Vector2(x, y));
+            if (r <= radius) {
+                histogram[r].emplace_back(x, y);
+            }
         }
-	}
-	vector<Vector3> result;
-    for (vector<Vector3> &bin : histogram) {
-        if (use_color_median) {
-            Vector3 best(0, 0, 0);
-            float best_cost = HUGE_VALF;
-            for (Vector3 anchor : bin) {
-                float cost = 0;
-                for (Vector3 other : bin) {
-                    cost += cv::norm(anchor - other);
-                }
-                if (cost < best_cost) {
-                    best = anchor;
-                    best_cost = cost;
-                }
+    }
+    for (const vector<Pixel> &bin : histogram) {
+        radius_begin.push_back(offsets.size());
+        for (Pixel p : bin) {
+            offsets.push_back(p);
+            angles.push_back((p.x or p.y) ? angle_address(to_vector(p), angular_bins) : 0);
+        }
+    }
+    radius_begin.push_back(offsets.size());
+    for (Pixel d : make_circle(radius)) {
+        rim.push_back(to_vector(d));
+        rim_angles.push_back(angle_address(rim.back(), angular_bins));
+    }
+}
+
+void RadialEye::radial_mean(Pixel center, const PolarTable &table, const Bitmap3 &img, vector<Vector3> &result) const
+{
+    const int radius_bins = table.radius_begin.size() - 1;
+    result.assign(radius_bins, Vector3(0, 0, 0));
+    vector<Vector3> bin;
+    for (int r=0; r < radius_bins and r < table.radius; ++r) {
+        bin.clear();
+        for (int i=table.radius_begin[r]; i<table.radius_begin[r + 1]; ++i) {
+            Pixel p = center + table.offsets[i];
+            if (p.x >= 0 and p.y >= 0 and p.x < img.cols and p.y < img.rows) {
+                bin.push_back(img(p));
             }
-            result.push_back(best);
+        }
+        if (bin.empty()) {
+            continue;
+        } else if (use_color_median) {
+            result[r] = approximate_medoid(bin);
         } else {
-            if (bin.empty()) {
-                result.emplace_back(0, 0, 0);
-            } else {
-                auto mid = bin.begin() + bin.size() / 2;
-                std::nth_element(bin.begin(), mid, bin.end(), [](Vector3 l, Vector3 r) {
-                    return cv::norm(l) < cv::norm(r);
-                });
-                result.push_back(*mid);
-            }
+            auto mid = bin.begin() + bin.size() / 2;
+            std::nth_element(bin.begin(), mid, bin.end(), [](Vector3 l, Vector3 r) {
+                return l.dot(l) < r.dot(r);
+            });
+            result[r] = *mid;
         }
     }
-    return result;
 }
 
-float RadialEye::eval(Circle c, const Bitmap3 &img, const Bitmap1 &dx, const Bitmap1 &dy) const
+float RadialEye::eval(Pixel center, const PolarTable &table, const Bitmap3 &img, const Bitmap1 &dx, const Bitmap1 &dy) const
 {
-    const int angular_bins = 2 * c.radius * M_PI;
+    const int angular_bins = table.angular_bins;
 	// calculate average over each radius
-	vector<Vector3> colors = radial_mean(c, img);
+	vector<Vector3> colors;
+	radial_mean(center, table, img, colors);
 	// calculate score of each angle, based on the gradient at its end
-	std::vector<float> limbus_score(angular_bins);
-    const Curve circle = make_circle(c.radius);
-    for (Pixel d : circle) {
-        Vector2 diff = to_vector(d);
-        Vector2 v = c.center + diff;
+	std::vector<float> limbus_score(angular_bins, 0);
+    const Vector2 world_center = img.to_world(center);
+    for (int i=0; i<table.rim.size(); ++i) {
+        Vector2 diff = table.rim[i];
+        Vector2 v = world_center + diff;
         if (img.contains(v)) {
-            int index = angle_address(diff, angular_bins);
-            limbus_score[index] = grad_func(Vector2(dx(v), dy(v)), diff);
+            limbus_score[table.rim_angles[i]] = grad_func(Vector2(dx(v), dy(v)), diff);
         }
 	}
 	std::vector<float> iris_score(angular_bins, 0);
 	std::vector<float> iris_weight(angular_bins, 0);
-	for (Pixel p : sampling(img)) {
-        Vector2 diff = img.to_world(p) - c.center;
-        int r = cv::norm(diff);
-        if (r <= c.radius and r != 0) {
-            float rs = std::max(0.0, 1 - cv::norm(colors[r] - img(p)) / 20);
-            int index = angle_address(diff, angular_bins);
-            iris_score[index] += rs;
-            iris_weight[index] += 1;
+    for (int r=1; r<colors.size(); ++r) {
+        for (int i=table.radius_begin[r]; i<table.radius_begin[r + 1]; ++i) {
+            Pixel p = center + table.offsets[i];
+            if (p.x >= 0 and p.y >= 0 and p.x < img.cols and p.y < img.rows) {
+                float rs = std::max(0.0, 1 - cv::norm(colors[r] - img(p)) / 20);
+                iris_score[table.angles[i]] += rs;
+                iris_weight[table.angles[i]] += 1;
+            }
         }
 	}
 	float result = 0;
@@ -396,19 +676,21 @@ float RadialEye::eval(Circle c, const Bitmap3 &img, const Bitmap1 &dx, const Bit
 	return result;
 }
 
-void RadialEye::refit(Circle &c, const Bitmap3 &img) const
+float RadialEye::refit(Circle &c, const EyeFeatures &features) const
 {
-    Bitmap1 gray = img.grayscale(to_region(2 * c));
-    if (not gray.rows or not gray.cols) {
+    if (features.gray().empty()) {
         error_message(c);
-        return;
+        return 0;
     }
-    const Bitmap1 dx = gray.d(0), dy = gray.d(1);
-	Bitmap1 score = gray.crop(to_region(c));
+    const Bitmap3 &img = features.img;
+    const Bitmap1 &dx = features.dx(), &dy = features.dy();
+	Bitmap1 score = features.gray().crop(to_region(c)).clone();
+    const PolarTable table(c.radius, img.scale);
     for (Pixel p : sampling(score)) {
-        Circle candidate{score.to_world(p), c.radius};
-        Bitmap3 cropout = img.crop(to_region(candidate));
-        score(p) = eval(candidate, cropout, dx, dy);
+        Vector2 center = img.to_local(score.to_world(p));
+        score(p) = eval(Pixel(cvRound(center[0]), cvRound(center[1])), table, img, dx, dy);
 	}
-	c.center = precise_maximum(score);
+	const Peak peak = find_peak(score);
+	c.center = peak.position;
+	return peak.sharpness;
 }
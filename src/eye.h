@@ -1,23 +1,62 @@
 #ifndef EYE_H
 #define EYE_H
 #include <memory>
+#include <map>
 #include "main.h"
 #include "bitmap.h"
 
+/** Images of the neighborhood of one eye in one frame
+ * Each image is calculated on first use and then shared by all localizers that refit this eye.
+ * The neighborhood is wide enough for each localizer to crop its own region, even after the eye has moved a bit.
+ */
+class EyeFeatures
+{
+    mutable std::once_flag gray_flag, gradient_flag, hessian_flag, hsv_flag;
+    mutable Bitmap1 gray_img, dx_img, dy_img, dxx_img, dxy_img, dyy_img;
+    mutable Bitmap3 hsv_img;
+public:
+    const Bitmap3 img;  ///< Color crop of the frame, empty if the eye is outside
+    /** @param neighborhood Size of the crop relative to the eye radius
+     * @param min_margin Least distance in pixels from the eye boundary to the border of the crop, which matters for small eyes
+     */
+    EyeFeatures(const Bitmap3 &frame, Circle eye, float neighborhood=4, float min_margin=8);
+    const Bitmap1& gray() const;
+    const Bitmap1& dx() const;
+    const Bitmap1& dy() const;
+    const Bitmap1& dxx() const;
+    const Bitmap1& dxy() const;
+    const Bitmap1& dyy() const;
+    /// Hue in degrees, saturation and value
+    const Bitmap3& hsv() const;
+};
+
 class FindEye
 {
 public:
-    virtual void refit(Circle&, const Bitmap3&) const = 0;
+    virtual ~FindEye() = default;
+    
+    /** Move the circle onto the eye in view
+     * @return Confidence of the result from 0 to 1, comparable only between results of the same localizer
+     */
+    virtual float refit(Circle&, const EyeFeatures&) const = 0;
+    
+    /** Refit a single eye without sharing its features
+     */
+    float refit(Circle&, const Bitmap3&) const;
 };
 using FindEyePtr = std::unique_ptr<FindEye>;
 
 /** Eye localizer that combines several other algorithms by voting
+ * The children run concurrently on the OpenMP thread pool, unless disabled.
  */
 class ParallelEye : public FindEye
 {
     vector<FindEyePtr> children;
+    bool is_concurrent;
 public:
-    virtual void refit(Circle&, const Bitmap3&) const;
+    ParallelEye(bool is_concurrent=true) : is_concurrent(is_concurrent) { }
+    using FindEye::refit;
+    virtual float refit(Circle&, const EyeFeatures&) const;
     void add(FindEyePtr&&);
 };
 
@@ -27,10 +66,25 @@ class SerialEye : public FindEye
 {
     vector<FindEyePtr> children;
 public:
-    virtual void refit(Circle&, const Bitmap3&) const;
+    using FindEye::refit;
+    virtual float refit(Circle&, const EyeFeatures&) const;
     void add(FindEyePtr&&);
 };
 
+/** Eye localizer that runs several other algorithms in sequence, until one of them is confident enough
+ * Cheap stages go first, so that the expensive ones are only needed for difficult frames.
+ * Every stage starts from the initial circle. If none is confident enough, the most confident result is kept.
+ */
+class CascadeEye : public FindEye
+{
+    vector<std::pair<FindEyePtr, float>> stages;
+public:
+    using FindEye::refit;
+    virtual float refit(Circle&, const EyeFeatures&) const;
+    /// @param sufficient_confidence If the stage reports at least this, all later stages are skipped
+    void add(FindEyePtr&&, float sufficient_confidence=1);
+};
+
 /** Subpixel Hough circle detector with fixed radius
  */
 class HoughEye : public FindEye
@@ -40,7 +94,23 @@ class HoughEye : public FindEye
     bool hsv_bounded(Vector3) const;
 public:
     HoughEye(Vector3 hsv_low={0,0,0}, Vector3 hsv_high={1,1,1}) : hsv_low(hsv_low), hsv_high(hsv_high) { }
-    virtual void refit(Circle&, const Bitmap3&) const;
+    using FindEye::refit;
+    virtual float refit(Circle&, const EyeFeatures&) const;
+};
+
+/** Subpixel Hough circle detector over a range of radii
+ * All radii vote in a single pass into a stack of accumulators, so that the radius is estimated along with the center.
+ */
+class MultiHoughEye : public FindEye
+{
+    const float min_scale;
+    const float max_scale;
+    const int radius_count;
+public:
+    /// Radii from min_scale to max_scale times the current one are tried
+    MultiHoughEye(float min_scale=0.8, float max_scale=1.25, int radius_count=5) : min_scale(min_scale), max_scale(max_scale), radius_count(radius_count) { }
+    using FindEye::refit;
+    virtual float refit(Circle&, const EyeFeatures&) const;
 };
 
 /** Maximize sum of gradient towards the eye center
@@ -48,21 +118,26 @@ public:
 class LimbusEye : public FindEye
 {
     const float max_distance;
-    /// Derivative of the energy function wrt. center coordinate `direction`
-    float dp(Circle, int direction, const Bitmap1&) const;
+    /// Derivative of the energy function wrt. the center, from the second derivatives of the image
+    Vector2 gradient(Circle, const Bitmap1 &dxx, const Bitmap1 &dxy, const Bitmap1 &dyy) const;
+    /// Share of the gradient magnitude along the circle that points away from its center
+    float energy(Circle, const Bitmap1 &dx, const Bitmap1 &dy) const;
 public:
     LimbusEye(float max_distance=1) : max_distance(max_distance) { }
-    virtual void refit(Circle&, const Bitmap3&) const;
+    using FindEye::refit;
+    virtual float refit(Circle&, const EyeFeatures&) const;
 };
 
 /** Normalized correlation with a circle
+ * The template is bright outside a dark disk, so it correlates through sums over rectangles and row spans, without any template image.
  */
 class CorrelationEye : public FindEye
 {
     float scale;
 public:
     CorrelationEye(float neighborhood=1.5) : scale(neighborhood) { }
-    virtual void refit(Circle&, const Bitmap3&) const;
+    using FindEye::refit;
+    virtual float refit(Circle&, const EyeFeatures&) const;
 };    
 
 /** Normalized correlation with a custom bitmap
@@ -71,23 +146,47 @@ class BitmapEye : public FindEye
 {
     float scale;
     float radius_scale;
-    vector<Matrix> templ;
+    cv::Mat templ;  ///< Color channels of the template
+    Matrix templ_mask;  ///< Alpha channel of the template, if it has one
+    struct Resized
+    {
+        cv::Mat templ;
+        Matrix mask;
+    };
+    /// Template resized for each radius used so far, in pixels
+    mutable std::map<int, Resized> resized;
+    mutable std::mutex resized_mutex;
+    const Resized& resize(int radius) const;
 public:
     BitmapEye(const string filename, float radius_scale=1, float neighborhood=2);
-    virtual void refit(Circle&, const Bitmap3&) const;
+    using FindEye::refit;
+    virtual float refit(Circle&, const EyeFeatures&) const;
 };    
 
 /** Model based on radial symmetry of the iris and pupil
  */
 class RadialEye : public FindEye
 {
+    /// Pixel offsets within a circle in polar bins, shared by all candidate centers of one refit
+    struct PolarTable
+    {
+        int angular_bins;
+        float radius;
+        vector<Pixel> offsets;  ///< all pixels of the disk, ordered by radius bin
+        vector<int> angles;  ///< angular bin of each offset
+        vector<int> radius_begin;  ///< first offset of each radius bin, and the end of the last one
+        vector<Vector2> rim;  ///< points along the circle boundary, relative to the center
+        vector<int> rim_angles;
+        PolarTable(float radius, float scale);
+    };
     bool use_color_median;
-    float eval(Circle, const Bitmap3&, const Bitmap1&, const Bitmap1&) const;
-    vector<Vector3> radial_mean(Circle, const Bitmap3&) const;
+    float eval(Pixel, const PolarTable&, const Bitmap3&, const Bitmap1&, const Bitmap1&) const;
+    void radial_mean(Pixel, const PolarTable&, const Bitmap3&, vector<Vector3> &result) const;
     static int angle_address(Vector2, int);
     static float grad_func(Vector2, Vector2);
 public:
     RadialEye(bool use_color_median=true) : use_color_median(use_color_median) {}
-    virtual void refit(Circle&, const Bitmap3&) const;    
+    using FindEye::refit;
+    virtual float refit(Circle&, const EyeFeatures&) const;    
 };
 #endif // EYE_H
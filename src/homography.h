@@ -1,3 +1,5 @@
+#ifndef HOMOGRAPHY_H
+#define HOMOGRAPHY_H
 #include "vector_math.h"
 #include <iostream>
 
@@ -26,75 +28,153 @@ float evaluate_homography(const cv::Matx<float, N, M> &h, const vector<std::pair
     return 0.5 * value;
 }
 
+/** Result of a nonlinear refinement
+ */
+struct RefitReport
+{
+    int iterations;
+    float cost; ///< Half the sum of squared reprojection errors, as by evaluate_homography
+};
+
+/** Minimize the reprojection error by Levenberg-Marquardt with analytic derivatives
+ * Each iteration accumulates the fixed-size normal equations over all pairs once,
+ * a rejected step only costs another evaluation with stronger damping.
+ */
 template<int N, int M>
-void refit_homography(cv::Matx<float, N, M> &h, const vector<std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>>> &pairs)
+RefitReport refit_homography(cv::Matx<float, N, M> &h, const vector<std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>>> &pairs, int max_iterations=10)
 {
     using Homography = cv::Matx<float, N, M>;
-    for (int iteration=0; iteration<10; iteration++) {
-        Homography gradient = Homography::zeros();
+    using Normal = cv::Matx<double, N*M, N*M>;
+    using Params = cv::Vec<double, N*M>;
+    RefitReport report{0, evaluate_homography(h, pairs)};
+    double damping = 1e-3;
+    while (report.iterations < max_iterations and report.cost > 0) {
+        Normal jtj = Normal::zeros();
+        Params jtr;
         for (auto pair : pairs) {
-            cv::Vec<float, N-1> projection = project(pair.first, h);
-            cv::Vec<float, N-1> diff = projection - pair.second;
-            cv::Vec<float, N> rowwise_component;
-            for (int i=0; i<N-1; i++) {
-                rowwise_component[i] = diff[i];
-                rowwise_component[N-1] -= diff[i] * projection[i];
+            const cv::Vec<float, M> x = homogenize(pair.first);
+            const cv::Vec<float, N> q = h * x;
+            for (int i=0; i<N-1; ++i) {
+                // derivative of q[i] / q[N-1] by each element of h
+                const double projection = q[i] / q[N-1];
+                Params row;
+                for (int j=0; j<M; ++j) {
+                    row[i * M + j] = x[j] / q[N-1];
+                    row[(N-1) * M + j] = -projection * x[j] / q[N-1];
+                }
+                jtj += row * row.t();
+                jtr += row * (projection - pair.second[i]);
             }
-            gradient += Homography(Matrix(Matrix(rowwise_component) * Matrix(homogenize(pair.first)).t()));
         }
-        float value = evaluate_homography(h, pairs);
-        float grad_norm = cv::norm(gradient, cv::NORM_L2SQR);
-        float step_size = 1 / grad_norm;//value / std::max(1.f, grad_norm);
-        while (evaluate_homography(h - gradient * step_size, pairs) > value) {
-            step_size /= 2;
-            if (step_size < 1e-20) {
-                //printf("resulting value: %g; stop because step_size = %g\n", evaluate_homography(h, pairs), step_size);
-                return;
+        report.iterations += 1;
+        float decrease = 0;
+        for (; damping < 1e10; damping *= 10) {
+            Normal system = jtj;
+            for (int k=0; k<N*M; ++k) {
+                system(k, k) += damping * jtj(k, k) + 1e-12;
+            }
+            const Params step = system.solve(jtr, cv::DECOMP_CHOLESKY);
+            Homography candidate = h;
+            for (int k=0; k<N*M; ++k) {
+                candidate.val[k] -= step[k];
             }
+            const float cost = evaluate_homography(candidate, pairs);
+            if (cost < report.cost) {
+                decrease = report.cost - cost;
+                h = candidate;
+                report.cost = cost;
+                damping = std::max(damping / 10, 1e-12);
+                break;
+            }
+        }
+        if (decrease <= 1e-6 * report.cost) {
+            break;
         }
-        //printf("value after %i iterations: %g; choosing step %g\n", i, value, step_size);
-        //std::cout << gradient * step_size << std::endl;
-        h -= gradient * step_size;
     }
-    //printf("resulting value: %g\n", evaluate_homography(h, pairs));
+    return report;
 }
 
-/** Direct linear transform from pair.first to pair.second
+/** Centering and scaling of both sides of the correspondences, so that the linear system is well conditioned
  */
 template<int N, int M>
-cv::Matx<float, N, M> homography(const vector<std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>>> &pairs)
+struct DltFrame
 {
-    using Homography = cv::Matx<float, N, M>;
-    cv::Vec<float, M-1> center_left, variance_left;
-    cv::Vec<float, N-1> center_right, variance_right;
-    int count = 0;
-    for (auto pair : pairs) {
-        count += 1;
-        variance_left += pow2(pair.first - center_left) * (count - 1) / count;
-        variance_right += pow2(pair.second - center_right) * (count - 1) / count;
-        center_left += (pair.first - center_left) / count;
-        center_right += (pair.second - center_right) / count;
+    cv::Vec<float, M-1> center_left, stddev_left;
+    cv::Vec<float, N-1> center_right, stddev_right;
+
+    DltFrame() = default;
+    DltFrame(const vector<std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>>> &pairs)
+    {
+        cv::Vec<float, M-1> variance_left;
+        cv::Vec<float, N-1> variance_right;
+        int count = 0;
+        for (auto pair : pairs) {
+            count += 1;
+            variance_left += pow2(pair.first - center_left) * (count - 1) / count;
+            variance_right += pow2(pair.second - center_right) * (count - 1) / count;
+            center_left += (pair.first - center_left) / count;
+            center_right += (pair.second - center_right) / count;
+        }
+        stddev_left = sqrt(variance_left);
+        stddev_right = sqrt(variance_right);
     }
-    cv::Vec<float, M-1> stddev_left = sqrt(variance_left);
-    cv::Vec<float, N-1> stddev_right = sqrt(variance_right);
-    Matrix system(0, N*M);
-    for (auto pair : pairs) {
+
+    /** Call fn with the constraint matrices of one correspondence in normalized coordinates
+     * The normalized homography h satisfies sum(row .* h) = 0 for each of them.
+     */
+    template<typename Function>
+    void constraints(const std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>> &pair, Function fn) const
+    {
         auto lhs = homogenize((pair.first - center_left) / stddev_left);
         auto rhs = homogenize((pair.second - center_right) / stddev_right);
         int i = max_component(rhs);
         for (int j=0; j<N; ++j) {
             if (i != j) {
-                Matrix row(cross_axes<N>(i, j) * rhs * lhs.t());
-                system.push_back(row.reshape(1, 1));
+                fn(cv::Matx<float, N, M>(cross_axes<N>(i, j) * rhs * lhs.t()));
             }
         }
     }
+
+    /** Add the constraints of one correspondence, multiplied by weight, to the scatter matrix of the normalized system
+     */
+    void scatter(cv::Matx<double, N*M, N*M> &result, const std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>> &pair, double weight=1) const
+    {
+        constraints(pair, [&result, weight](const cv::Matx<float, N, M> &row) {
+            cv::Vec<double, N*M> r;
+            for (int k=0; k<N*M; ++k) {
+                r[k] = row.val[k];
+            }
+            result += weight * r * r.t();
+        });
+    }
+
+    Matrix normalize() const
+    {
+        return scaling(stddev_left, true) * translation(center_left, true);
+    }
+
+    Matrix denormalize() const
+    {
+        return translation(center_right) * scaling(stddev_right);
+    }
+};
+
+/** Direct linear transform by SVD of the whole system, one pair of rows for each correspondence
+ * Every right singular vector is tried, the best one in terms of reprojection error is returned.
+ */
+template<int N, int M>
+cv::Matx<float, N, M> homography_svd(const vector<std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>>> &pairs)
+{
+    using Homography = cv::Matx<float, N, M>;
+    const DltFrame<N, M> frame(pairs);
+    Matrix system(0, N*M);
+    for (auto pair : pairs) {
+        frame.constraints(pair, [&system](const Homography &row) { system.push_back(Matrix(row).reshape(1, 1)); });
+    }
     Matrix vt = cv::SVD(system, cv::SVD::FULL_UV).vt;
     float best_error = 1e20;
     Homography result;
-    Matrix normalize = scaling(stddev_left, true) * translation(center_left, true);
-    Matrix denormalize = translation(center_right) * scaling(stddev_right);
-    Matrix tmp_best_h;
+    const Matrix normalize = frame.normalize(), denormalize = frame.denormalize();
     for (int i=0; i<vt.rows; ++i) {
         Matrix h = vt.row(i).reshape(1, N);
         Homography candidate = Matrix(denormalize * h * normalize);
@@ -102,30 +182,84 @@ cv::Matx<float, N, M> homography(const vector<std::pair<cv::Vec<float, M-1>, cv:
         if (error < best_error) {
             best_error = error;
             result = candidate;
-            tmp_best_h = h;
         }
     }
-    static size_t prev_count = 0;
-    if (false and prev_count != pairs.size()) {
-        std::cout << "solving:\nin = [";
-        for (auto pair:pairs) {
-            std::cout << homogenize(pair.first) /*homogenize((pair.first - center_left) / stddev_left)*/ << ';' << std::endl;
+    return result;
+}
+
+/** Homography from the scatter matrix of the normalized system, as summed by DltFrame::scatter over the pairs
+ * The eigenvector of the smallest eigenvalue is returned, unless several eigenvalues are negligible;
+ * then the system is degenerate and the best of their eigenvectors in terms of reprojection error is returned.
+ */
+template<int N, int M>
+cv::Matx<float, N, M> homography_from_scatter(const cv::Matx<double, N*M, N*M> &scatter, const DltFrame<N, M> &frame, const vector<std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>>> &pairs)
+{
+    using Homography = cv::Matx<float, N, M>;
+    using Scatter = cv::Matx<double, N*M, N*M>;
+    cv::Matx<double, N*M, 1> values;
+    Scatter vectors;
+    cv::eigen(scatter, values, vectors);
+    float best_error = 1e20;
+    Homography result;
+    const Matrix normalize = frame.normalize(), denormalize = frame.denormalize();
+    // the eigenvalues are sorted in descending order
+    const double tolerance = 1e-3 * values(0);
+    for (int i=N*M-1; i>=0; --i) {
+        if (i < N*M-1 and values(i) > tolerance and best_error < 1e20) {
+            break;
+        }
+        Matrix h(N, M);
+        for (int k=0; k<N*M; ++k) {
+            h(k / M, k % M) = vectors(i, k);
         }
-        std::cout << "]';\nout = [";
-        for (auto pair:pairs) {
-            std::cout << homogenize(pair.second) /*homogenize((pair.second - center_right) / stddev_right)*/ << ';' << std::endl;
+        Homography candidate = Matrix(denormalize * h * normalize);
+        float error = evaluate_homography<N, M>(candidate, pairs);
+        if (error < best_error) {
+            best_error = error;
+            result = candidate;
         }
-        std::cout << "]';\n";
-        std::cout << "system = " << system << ';' << std::endl;
-        auto svd = cv::SVD(system, cv::SVD::FULL_UV);
-        std::cout << "u:\n" /*<< svd.u*/ << "\nd:\n" << svd.w << "\nvt:\n" << svd.vt << std::endl;
-        std::cout << "result\n" << denormalize << " * " << tmp_best_h << " * " << normalize << std::endl;
-        prev_count = pairs.size();
     }
+    return result;
+}
+
+/** Direct linear transform by eigendecomposition of the scatter matrix of the system
+ * Memory does not depend on the count of correspondences, and the only decomposition is of a fixed size.
+ * The scatter squares the condition number of the system, so it is summed in double precision.
+ */
+template<int N, int M>
+cv::Matx<float, N, M> homography_scatter(const vector<std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>>> &pairs)
+{
+    using Scatter = cv::Matx<double, N*M, N*M>;
+    const DltFrame<N, M> frame(pairs);
+    Scatter scatter = Scatter::zeros();
+    for (auto pair : pairs) {
+        frame.scatter(scatter, pair);
+    }
+    return homography_from_scatter(scatter, frame, pairs);
+}
+
+/** Direct linear transform from pair.first to pair.second, without any refinement
+ * The solver is chosen at compile time, DLT_SVD selects the former one that decomposes the whole system.
+ */
+template<int N, int M>
+cv::Matx<float, N, M> homography_linear(const vector<std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>>> &pairs)
+{
+#if defined DLT_SVD
+    return homography_svd<N, M>(pairs);
+#else
+    return homography_scatter<N, M>(pairs);
+#endif
+}
+
+/** Direct linear transform from pair.first to pair.second, refined by Levenberg-Marquardt if overdetermined
+ */
+template<int N, int M>
+cv::Matx<float, N, M> homography(const vector<std::pair<cv::Vec<float, M-1>, cv::Vec<float, N-1>>> &pairs)
+{
+    cv::Matx<float, N, M> result = homography_linear<N, M>(pairs);
     if (pairs.size() > (M*N - 1) / (N-1)) {
-        //printf("initial %g, ", evaluate_homography(result, pairs));
         refit_homography(result, pairs);
-        //printf("final %g\n", evaluate_homography(result, pairs));
     }
     return result;
 }
+#endif
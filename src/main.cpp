@@ -102,8 +102,11 @@ void set_eye_finder(Face& face)
 
 void display_help()
 {
-	printf("Usage: fit_eyes [-i] [-v] [index of webcam] [video.avi [ground_truth.csv]]\n");
+	printf("Usage: fit_eyes [-i] [-v] [-c] [-j<threads>] [-s<pixels>] [index of webcam] [video.avi [ground_truth.csv]]\n");
 	printf("\t-i:\tinteractive (mark the face by hand)\n");
+	printf("\t-c:\tinverse compositional face tracking\n");
+	printf("\t-j:\tnumber of threads used for face tracking\n");
+	printf("\t-s:\tsparse face tracking on this many pixels per pyramid level\n");
 	printf("\t-v:\tverbose\n");
 }
 
@@ -113,13 +116,20 @@ int main(int argc, char** argv)
 	int camera_index = 0;
 	int frame_begin = 0, frame_step = 1;
 	std::vector<int> numeric_args;
-	bool is_interactive = false, is_verbose = false;
+	bool is_interactive = false, is_verbose = false, is_compositional = false;
+	int pixel_budget = 0, thread_count = 0;
 	for (int i=1; i<argc; ++i) {
 		string arg(argv[i]);
 		if (arg == "-i") {
 			is_interactive = true;
 		} else if (arg == "-v") {
 			is_verbose = true;
+		} else if (arg == "-c") {
+			is_compositional = true;
+		} else if (arg.size() > 2 and arg.compare(0, 2, "-j") == 0 and is_numeric(arg.substr(2))) {
+			thread_count = std::stoi(arg.substr(2));
+		} else if (arg.size() > 2 and arg.compare(0, 2, "-s") == 0 and is_numeric(arg.substr(2))) {
+			pixel_budget = std::stoi(arg.substr(2));
 		} else if (arg == "-h") {
 			display_help();
 			return 0;
@@ -131,6 +141,7 @@ int main(int argc, char** argv)
 			std::swap(csv_filename, arg);
 		}
 	}
+	set_thread_count(thread_count);
 	if (not video_filename.empty() and csv_filename.empty()) {
 		csv_filename = replace_extension(video_filename, ".csv");
 	}
@@ -165,6 +176,12 @@ int main(int argc, char** argv)
         Face state = (is_interactive) ? init_interactive(reference_image) : init_static(reference_image);
         std::cout << " marked " << state() << std::endl;
         set_eye_finder(state);
+        if (is_compositional) {
+            state.set_solver(Solver::inverse_compositional);
+        }
+        if (pixel_budget > 0) {
+            state.set_pixel_budget(pixel_budget);
+        }
         if (video_filename.empty()) {
             Pixel size(1650, 1000);
             Gaze fit = calibrate_interactive(state, cam, size);
@@ -5,145 +5,416 @@
 #include <iostream>
 #include <random>
 #include <mutex>
+#include <numeric>
 #include <opencv2/objdetect.hpp>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-template<int size>
-vector<Measurement> random_sample(const vector<Measurement> &pairs)
+/** Distinct random indices below count, by Floyd's algorithm
+ * @param count Has to be at least size
+ */
+template<int size, typename Generator>
+void random_indices(int count, Generator &generator, std::array<int, size> &out)
+{
+    for (int i=0; i<size; i++) {
+        const int high = count - size + i;
+        const int index = std::uniform_int_distribution<>(0, high)(generator);
+        auto it = out.begin() + i;
+        *it = (std::find(out.begin(), it, index) == it) ? index : high;
+    }
+}
+
+/** Fill the sample with distinct random measurements, or all of them if there are too few
+ * The output keeps its capacity, so that it does not have to allocate when reused.
+ */
+template<int size, typename Generator>
+void random_sample(const vector<Measurement> &pairs, Generator &generator, vector<Measurement> &out)
 {
+    out.clear();
     if (pairs.size() <= size) {
-        return vector<Measurement>(pairs.begin(), pairs.end());
+        out.insert(out.end(), pairs.begin(), pairs.end());
+        return;
     }
     std::array<int, size> indices;
-    std::random_device rd;
-    std::minstd_rand generator(rd());
-    for (int i=0; i<size; i++) {
-        int high = pairs.size() - size + i;
-        auto it = indices.begin() + i;
-        int index = std::uniform_int_distribution<>(0, high - 1)(generator);
-        *it = (std::find(indices.begin(), it, index) == it) ? index : high;
-    }
-    vector<Measurement> result;
-    result.reserve(size);
-    std::transform(indices.begin(), indices.end(), std::back_inserter(result), [pairs](int index) { return pairs[index]; });
-    return result;
+    random_indices<size>(pairs.size(), generator, indices);
+    for (int index : indices) {
+        out.push_back(pairs[index]);
+    }
 }
 
-vector<Measurement> support(const Matrix35 h, const vector<Measurement> &pairs, const float precision)
+bool is_inlier(const Matrix35 &h, const Measurement &pair, float precision)
 {
-    vector<Measurement> result;
-    std::copy_if(pairs.begin(), pairs.end(), std::back_inserter(result), [h, precision](Measurement p) { return cv::norm(project(p.first, h) - p.second) < precision; });
-    return result;
+    return cv::norm(project(pair.first, h) - pair.second, cv::NORM_L2SQR) < pow2(precision);
+}
+
+/** Fill the output with measurements that agree with the homography, reusing its capacity
+ */
+void support(const Matrix35 &h, const vector<Measurement> &pairs, float precision, vector<Measurement> &out)
+{
+    out.clear();
+    for (const Measurement &pair : pairs) {
+        if (is_inlier(h, pair, precision)) {
+            out.push_back(pair);
+        }
+    }
 }
 
 template<int count>
 float combinations_ratio(int count_total, int count_good)
 {
     const float logp = -1;
-    float result = logp / std::log(1 - pow(count_good / float(count_total), count));
-    printf(" need %g samples (%i over %i)\n", result, count_good, count_total);
-    return result;
+    return logp / std::log(1 - pow(count_good / float(count_total), count));
 }
 
 Gaze::Gaze(const Matrix35 &fn) : fn(fn)
 {
 }
 
-Gaze Gaze::ransac(const vector<Measurement> &pairs, int &out_support, float precision)
+/** Seed of the generator for one ransac iteration, well spread even for consecutive iterations
+ */
+unsigned iteration_seed(unsigned seed, int iteration)
+{
+    uint32_t x = seed + 0x9e3779b9u * uint32_t(iteration + 1);
+    x = (x ^ (x >> 16)) * 0x85ebca6bu;
+    x = (x ^ (x >> 13)) * 0xc2b2ae35u;
+    return x ^ (x >> 16);
+}
+
+Gaze Gaze::ransac(const vector<Measurement> &pairs, int &out_support, float precision, unsigned seed)
 {
     const int necessary_support = out_support;
-    out_support = 0;
     const int min_sample = 7;
     float iterations = 1 + combinations_ratio<min_sample>(pairs.size(), necessary_support);
+    int best_support = 0;
     Matrix35 result;
-    for (int i=0; i < iterations; i++) {
-        vector<Measurement> sample = random_sample<min_sample>(pairs);
-        size_t prev_sample_size;
-        Matrix35 h = homography<3, 5>(sample);
-        do {
-            prev_sample_size = sample.size();
-            h = homography<3, 5>(sample);
-            sample = support(h, pairs, precision);
-        } while (sample.size() > prev_sample_size);
-        if (sample.size() > out_support) {
-            out_support = sample.size();
-            result = h;
-            if (sample.size() >= necessary_support) {
-                iterations = combinations_ratio<min_sample>(pairs.size(), sample.size());
+    vector<Measurement> best_inliers;
+    if (seed == 0) {
+        seed = std::random_device()();
+    }
+    // hypotheses are evaluated in parallel by batches, each iteration has a generator of its own
+    // and the results are then taken in the order of iterations, so they do not depend on threading
+    constexpr int batch_size = 16;
+    std::array<vector<Measurement>, batch_size> samples;
+    std::array<Matrix35, batch_size> hypotheses;
+    for (vector<Measurement> &sample : samples) {
+        sample.reserve(pairs.size());
+    }
+    for (int batch_start = 0; batch_start < iterations; batch_start += batch_size) {
+        const int count = std::min<float>(batch_size, std::ceil(iterations) - batch_start);
+        #pragma omp parallel for schedule(dynamic)
+        for (int i=0; i<count; ++i) {
+            std::minstd_rand generator(iteration_seed(seed, batch_start + i));
+            vector<Measurement> &sample = samples[i];
+            random_sample<min_sample>(pairs, generator, sample);
+            size_t prev_sample_size;
+            Matrix35 h;
+            do {
+                prev_sample_size = sample.size();
+                h = homography_linear<3, 5>(sample);
+                support(h, pairs, precision, sample);
+            } while (sample.size() > prev_sample_size);
+            hypotheses[i] = h;
+        }
+        // the iteration count may drop within the batch, later hypotheses are then left out
+        for (int i=0; i<count and batch_start + i < iterations; ++i) {
+            if (samples[i].size() > best_support) {
+                best_support = samples[i].size();
+                best_inliers = samples[i];
+                result = hypotheses[i];
+                if (best_support >= necessary_support) {
+                    iterations = combinations_ratio<min_sample>(pairs.size(), best_support);
+                }
             }
         }
     }
+    // only the winning hypothesis is refined nonlinearly, on its inliers
+    if (best_inliers.size() > min_sample) {
+        Matrix35 refined = result;
+        refit_homography(refined, best_inliers);
+        vector<Measurement> inliers;
+        support(refined, pairs, precision, inliers);
+        if (inliers.size() >= best_support) {
+            best_support = inliers.size();
+            result = refined;
+        }
+    }
+    out_support = best_support;
     return Gaze(result);
 }
 
-Gaze Gaze::guess(Safe<vector<Measurement>> &pairs, int &out_support, float precision)
+Vector2 Gaze::operator () (Vector4 v) const
 {
-    using Lock = std::lock_guard<Safe<vector<Measurement>>>;    
-    const int necessary_support = out_support;
-    out_support = 0;
-    vector<Measurement> sample;
-    {
-        Lock lk(pairs);
-        sample = random_sample<7>(pairs);
+    return project(v, fn);
+}
+
+/// Rank-one updates of the online gaze normal equations before they are summed again from the inliers
+const int rebuild_interval = 64;
+
+OnlineGaze::OnlineGaze(int necessary_support, float precision, float tolerance):
+    necessary_support{necessary_support},
+    precision{precision},
+    tolerance{tolerance}
+{
+}
+
+void OnlineGaze::accumulate(const Measurement &pair, double weight)
+{
+    frame.scatter(normal, pair, weight);
+    update_count += 1;
+}
+
+/** Sum the normal equations over the inliers from scratch
+ * Removing measurements by negative updates accumulates rounding errors, this discards them.
+ */
+void OnlineGaze::rebuild()
+{
+    normal = Normal::zeros();
+    for (int i=0; i<measurements.size(); ++i) {
+        if (is_inlier[i]) {
+            accumulate(measurements[i], 1);
+        }
     }
-    Matrix35 h = homography<3, 5>(sample);
-    do {
-        out_support = sample.size();
-        h = homography<3, 5>(sample);
-        {
-            Lock lk(pairs);
-            sample = support(h, pairs, precision);
+    update_count = 0;
+}
+
+int OnlineGaze::reclassify()
+{
+    int change_count = 0;
+    for (int i=0; i<measurements.size(); ++i) {
+        const Measurement &pair = measurements[i];
+        const bool is_good = cv::norm(project(pair.first, fn) - pair.second) < precision;
+        if (is_good != is_inlier[i]) {
+            accumulate(pair, is_good ? 1 : -1);
+            is_inlier[i] = is_good;
+            support += is_good ? 1 : -1;
+            change_count += 1;
         }
-    } while (sample.size() > out_support);
-    return Gaze(h);
+    }
+    return change_count;
 }
 
-Vector2 Gaze::operator () (Vector4 v) const
+void OnlineGaze::solve()
 {
-    return project(v, fn);
+    vector<Measurement> inliers;
+    for (int i=0; i<measurements.size(); ++i) {
+        if (is_inlier[i]) {
+            inliers.push_back(measurements[i]);
+        }
+    }
+    fn = homography_from_scatter(normal, frame, inliers);
+    refit_homography(fn, inliers);
 }
 
+void OnlineGaze::start()
+{
+    int ransac_support = necessary_support;
+    const Gaze initial = Gaze::ransac(measurements, ransac_support, precision);
+    if (ransac_support < necessary_support) {
+        // each new measurement adds at most one inlier, and the retries get sparser as the measurements pile up
+        next_start = measurements.size() + std::max<int>(necessary_support - ransac_support, measurements.size() / 8);
+        return;
+    }
+    // the coordinates are normalized once, by the measurements available so far
+    frame = DltFrame<3, 5>(measurements);
+    normal = Normal::zeros();
+    update_count = 0;
+    support = 0;
+    is_inlier.assign(measurements.size(), false);
+    fn = initial.fn;
+    has_estimate = true;
+    reclassify();
+}
+
+void OnlineGaze::add(const Measurement &pair)
+{
+    measurements.push_back(pair);
+    is_inlier.push_back(false);
+    if (not has_estimate) {
+        if (measurements.size() >= std::max(necessary_support, next_start)) {
+            start();
+        }
+        if (not has_estimate) {
+            return;
+        }
+    } else if (cv::norm(project(pair.first, fn) - pair.second) < precision) {
+        accumulate(pair, 1);
+        is_inlier.back() = true;
+        support += 1;
+    }
+    const Matrix35 previous = fn;
+    // the estimate and its inliers are refined until they agree
+    for (int iteration=0; iteration<3; ++iteration) {
+        if (support < necessary_support) {
+            has_estimate = false;
+            stable_count = 0;
+            next_start = measurements.size() + necessary_support - support;
+            return;
+        }
+        if (update_count > rebuild_interval) {
+            rebuild();
+        }
+        solve();
+        if (reclassify() == 0) {
+            break;
+        }
+    }
+    float shift = 0;
+    for (int i=0; i<measurements.size(); ++i) {
+        if (is_inlier[i]) {
+            shift = std::max<float>(shift, cv::norm(project(measurements[i].first, fn) - project(measurements[i].first, previous)));
+        }
+    }
+    stable_count = (shift < tolerance) ? stable_count + 1 : 0;
+}
+
+bool OnlineGaze::is_converged() const
+{
+    // the estimate has to stay still for several measurements in a row
+    return has_estimate and support >= necessary_support and stable_count >= 3;
+}
+
+Gaze OnlineGaze::operator () () const
+{
+    return Gaze(fn);
+}
+
+/// Size of the coarsest pyramid level for fitting the main transformation by gradient descent
+const int main_min_size = 5;
+
 Face::Face(const Bitmap3 &ref, Region region, Circle left_eye, Circle right_eye):
     ref{ref.clone()},
+    ref_pyramid{this->ref, level_count(radius(region), 3)},
     main_tsf{region},
-    children{this->ref, region},
+    children{ref_pyramid, region},
     eyes{left_eye, right_eye}
 {
 }
 
-Transformation::Params update_step(const Transformation &tsf, const Bitmap3 &img, const Bitmap3 &grad, const Bitmap3 &ref, int direction)
+Transformation::Params update_step(const Transformation &tsf, const Bitmap3 &img, const Bitmap3 &dx, const Bitmap3 &dy, const Bitmap3 &ref)
 {
-    Transformation::Params result;
     // formula : delta_tsf = -sum_pixel (img o tsf - ref)^t * gradient(img o tsf) * gradient(tsf)
     Transformation tsf_inv = tsf.inverse();
-    for (Pixel p : sampling(grad, tsf.region)) {
-        Vector2 v = grad.to_world(p), refv = tsf_inv(v);
-        if (ref.contains(refv)) {
-            Vector3 diff = img(v) - ref(refv);
-            result -= diff.dot(grad(p)) * tsf.d(refv, direction);
+    auto pixels = sampling(img, tsf.region);
+    // each row is summed separately, the rows are then added in a fixed order so that the result does not depend on threading
+    vector<Transformation::Params> row_sums(pixels.row_count());
+    #pragma omp parallel
+    {
+        vector<Vector2> positions, ref_positions;
+        vector<Vector3> gradients_x, gradients_y, ref_colors;
+        #pragma omp for schedule(static)
+        for (int row=0; row<pixels.row_count(); ++row) {
+            Span span = pixels.row(row);
+            positions.resize(span.count);
+            ref_positions.resize(span.count);
+            gradients_x.resize(span.count);
+            gradients_y.resize(span.count);
+            ref_colors.resize(span.count);
+            Vector2 start = img.to_world(span.start), step(img.scale, 0);
+            for (int i=0; i<span.count; ++i) {
+                positions[i] = start + float(i) * step;
+            }
+            tsf_inv(start, step, span.count, ref_positions.data());
+            // the derivatives are sampled in between their own pixels, which gives central differences
+            dx.sample(positions.data(), span.count, gradients_x.data());
+            dy.sample(positions.data(), span.count, gradients_y.data());
+            ref.sample(ref_positions.data(), span.count, ref_colors.data());
+            const Vector3 *colors = &img(span.start);
+            Transformation::Params &sum = row_sums[row];
+            for (int i=0; i<span.count; ++i) {
+                if (ref.contains(ref_positions[i])) {
+                    Vector3 diff = colors[i] - ref_colors[i];
+                    const std::array<Transformation::Params, 2> jacobian = tsf.d(ref_positions[i]);
+                    sum -= diff.dot(gradients_x[i]) * jacobian[0] + diff.dot(gradients_y[i]) * jacobian[1];
+                }
+            }
         }
     }
-    return result;
+    return std::accumulate(row_sums.begin(), row_sums.end(), Transformation::Params());
 }
 
 float evaluate(const Transformation &tsf, const Bitmap3 &img, const Bitmap3 &reference)
 {
-    float result = 0;
     // formula : energy = 1/2 * sum_pixel (img o tsf - ref)^2
-    for (Pixel p : sampling(reference, tsf.region)) {
-        Vector2 v = tsf(reference.to_world(p));
-        Vector3 diff = img(v) - reference(p);
-        result += diff.dot(diff);
-        if (not (std::isfinite(result) and result >= 0)) {
-            std::cout << "img@" << v << " = " << img(v) << std::endl;
-            std::cout << "ref@" << p << " = " << reference(p) << std::endl;
-            std::cout << diff << "**2 = " << diff.dot(diff) << std::endl;
-            assert(false);
+    auto pixels = sampling(reference, tsf.region);
+    vector<float> row_sums(pixels.row_count(), 0);
+    #pragma omp parallel
+    {
+        vector<Vector2> positions;
+        vector<Vector3> colors;
+        #pragma omp for schedule(static)
+        for (int row=0; row<pixels.row_count(); ++row) {
+            Span span = pixels.row(row);
+            positions.resize(span.count);
+            colors.resize(span.count);
+            tsf(reference.to_world(span.start), Vector2(reference.scale, 0), span.count, positions.data());
+            img.sample(positions.data(), span.count, colors.data());
+            const Vector3 *ref_colors = &reference(span.start);
+            float &sum = row_sums[row];
+            for (int i=0; i<span.count; ++i) {
+                Vector3 diff = colors[i] - ref_colors[i];
+                sum += diff.dot(diff);
+                if (not (std::isfinite(sum) and sum >= 0)) {
+                    std::cout << "img@" << positions[i] << " = " << colors[i] << std::endl;
+                    std::cout << "ref@" << span.start + Pixel(i, 0) << " = " << ref_colors[i] << std::endl;
+                    std::cout << diff << "**2 = " << diff.dot(diff) << std::endl;
+                    assert(false);
+                }
+            }
         }
-        assert(std::isfinite(result) and result >= 0);
     }
+    float result = std::accumulate(row_sums.begin(), row_sums.end(), 0.f);
+    assert(std::isfinite(result) and result >= 0);
     return 0.5 * result;
 }
 
+Transformation::Params update_step(const Transformation &tsf, const Bitmap3 &img, const Bitmap3 &dx, const Bitmap3 &dy, const PixelSet &ref)
+{
+    const int count = ref.positions.size();
+    vector<Vector2> positions(count);
+    vector<Vector3> colors(count), gradients_x(count), gradients_y(count);
+    std::transform(ref.positions.begin(), ref.positions.end(), positions.begin(), [&tsf](Vector2 v) { return tsf(v); });
+    img.sample(positions.data(), count, colors.data());
+    dx.sample(positions.data(), count, gradients_x.data());
+    dy.sample(positions.data(), count, gradients_y.data());
+    Transformation::Params result;
+    for (int i=0; i<count; ++i) {
+        Vector3 diff = colors[i] - ref.colors[i];
+        const std::array<Transformation::Params, 2> jacobian = tsf.d(ref.positions[i]);
+        result -= diff.dot(gradients_x[i]) * jacobian[0] + diff.dot(gradients_y[i]) * jacobian[1];
+    }
+    return result;
+}
+
+float evaluate(const Transformation &tsf, const Bitmap3 &img, const PixelSet &ref)
+{
+    const int count = ref.positions.size();
+    vector<Vector2> positions(count);
+    vector<Vector3> colors(count);
+    std::transform(ref.positions.begin(), ref.positions.end(), positions.begin(), [&tsf](Vector2 v) { return tsf(v); });
+    img.sample(positions.data(), count, colors.data());
+    float result = 0;
+    for (int i=0; i<count; ++i) {
+        Vector3 diff = colors[i] - ref.colors[i];
+        result += diff.dot(diff);
+    }
+    assert(std::isfinite(result) and result >= 0);
+    return 0.5 * result;
+}
+
+void set_thread_count(int count)
+{
+#ifdef _OPENMP
+    if (count > 0) {
+        omp_set_num_threads(count);
+    }
+    // the stages of Face::refit run concurrently and keep their own parallel loops
+    if (not omp_in_parallel()) {
+        omp_set_max_active_levels(2);
+    }
+#endif
+}
+
 /** Maximum difference caused by adding 'step' to 'tsf', in pixels
  * @param step Differential update of the transformation
  */
@@ -184,7 +455,8 @@ float quadratic_minimum(float f0, float f1, float df0)
     }
 }
 
-float line_search(Transformation::Params delta_tsf, float &prev_energy, float length, const Transformation &tsf, const Bitmap3 &img, const Bitmap3 &ref)
+template<typename Reference>
+float generic_line_search(Transformation::Params delta_tsf, float &prev_energy, float length, const Transformation &tsf, const Bitmap3 &img, const Reference &ref)
 {
     const int iteration_count = 2;
     const float epsilon = 1e-5;
@@ -208,25 +480,31 @@ float line_search(Transformation::Params delta_tsf, float &prev_energy, float le
     return length;
 }
 
-void refit_transformation(Transformation &tsf, const Bitmap3 &img, const Bitmap3 &ref, int min_size)
+float line_search(Transformation::Params delta_tsf, float &prev_energy, float length, const Transformation &tsf, const Bitmap3 &img, const Bitmap3 &ref)
+{
+    return generic_line_search(delta_tsf, prev_energy, length, tsf, img, ref);
+}
+
+float line_search(Transformation::Params delta_tsf, float &prev_energy, float length, const Transformation &tsf, const Bitmap3 &img, const PixelSet &ref)
+{
+    return generic_line_search(delta_tsf, prev_energy, length, tsf, img, ref);
+}
+
+void refit_transformation(Transformation &tsf, const FramePyramid &view, const Pyramid &ref, int min_size)
 {
     const int iteration_count = 2;
-    vector<std::pair<Bitmap3, Bitmap3>> pyramid = {{img, ref}};
-    for (float size=radius(tsf.region); size > min_size; size /= 2) {
-        auto &pair = pyramid.back();
-        pyramid.emplace_back(pair.first.downscale(), pair.second.downscale());
-    }
-    std::reverse(pyramid.begin(), pyramid.end());
-    for (const auto &pair : pyramid) {
-        Bitmap3 dx = pair.first.d(0), dy = pair.first.d(1);
-        float prev_energy = evaluate(tsf, pair.first, pair.second);
+    const int count = level_count(radius(tsf.region), min_size);
+    assert(count <= view.size() and count <= ref.size());
+    for (int i=count - 1; i >= 0; --i) {
+        const Bitmap3 &img = view[i].img, &dx = view[i].dx, &dy = view[i].dy, &reference = ref[i].img;
+        float prev_energy = evaluate(tsf, img, reference);
         for (int iteration=0; iteration < iteration_count; ++iteration) {
-            Transformation::Params delta_tsf = update_step(tsf, pair.first, dx, pair.second, 0) + update_step(tsf, pair.first, dy, pair.second, 1);
+            Transformation::Params delta_tsf = update_step(tsf, img, dx, dy, reference);
             float step_mag = 2 * step_length(delta_tsf, tsf);
             if (step_mag < 1e-10) {
                 break;
             }
-            float length = line_search(delta_tsf, prev_energy, pair.first.scale / step_mag, tsf, pair.first, pair.second);
+            float length = line_search(delta_tsf, prev_energy, img.scale / step_mag, tsf, img, reference);
             if (length > 0) {
                 tsf += length * delta_tsf;
             } else {
@@ -236,26 +514,284 @@ void refit_transformation(Transformation &tsf, const Bitmap3 &img, const Bitmap3
     }
 }
 
-void Face::refit(const Bitmap3 &img, bool only_eyes)
+void refit_transformation(Transformation &tsf, const FramePyramid &view, const vector<PixelSet> &ref)
 {
-    if (not only_eyes) {
-        refit_transformation(main_tsf, img, ref, 5);
-        children.refit(img, main_tsf);
+    const int iteration_count = 2;
+    assert(ref.size() <= view.size());
+    for (int i=ref.size() - 1; i >= 0; --i) {
+        const Bitmap3 &img = view[i].img, &dx = view[i].dx, &dy = view[i].dy;
+        float prev_energy = evaluate(tsf, img, ref[i]);
+        for (int iteration=0; iteration < iteration_count; ++iteration) {
+            Transformation::Params delta_tsf = update_step(tsf, img, dx, dy, ref[i]);
+            float step_mag = 2 * step_length(delta_tsf, tsf);
+            if (step_mag < 1e-10) {
+                break;
+            }
+            float length = line_search(delta_tsf, prev_energy, img.scale / step_mag, tsf, img, ref[i]);
+            if (length > 0) {
+                tsf += length * delta_tsf;
+            } else {
+                break;
+            }
+        }
     }
-    for (int i=0; i<2; ++i) {
-        if (not eye_locator) {
-            static bool has_notified = false;
-            if (not has_notified) {
-                has_notified = true;
-                fprintf(stderr, "Eye tracking has not been set up.\n");
+}
+
+/** Indices of at most budget pixels with strongest gradients, in the order of sampling(level.img, region)
+ * The region is split into a grid of about budget cells and only the strongest pixel in each cell is kept.
+ */
+template<typename RegionType>
+vector<int> strong_pixels(const Pyramid::Level &level, const RegionType &region, int budget)
+{
+    vector<Pixel> pixels;
+    vector<float> strength;
+    for (Pixel p : sampling(level.img, region)) {
+        Vector2 v = level.img.to_world(p);
+        Vector3 gradient_x = level.dx(v), gradient_y = level.dy(v);
+        pixels.push_back(p);
+        strength.push_back(gradient_x.dot(gradient_x) + gradient_y.dot(gradient_y));
+    }
+    vector<int> result;
+    if (pixels.size() <= budget) {
+        result.resize(pixels.size());
+        std::iota(result.begin(), result.end(), 0);
+        return result;
+    }
+    Rect bounds = cv::boundingRect(pixels);
+    const int cell_size = std::max(1, int(std::sqrt(float(pixels.size()) / budget)));
+    const int row_cells = bounds.width / cell_size + 1;
+    vector<int> best((bounds.height / cell_size + 1) * row_cells, -1);
+    for (int i=0; i<pixels.size(); ++i) {
+        Pixel cell = (pixels[i] - bounds.tl()) / cell_size;
+        int &index = best[cell.y * row_cells + cell.x];
+        if (index < 0 or strength[i] > strength[index]) {
+            index = i;
+        }
+    }
+    std::copy_if(best.begin(), best.end(), std::back_inserter(result), [](int index) { return index >= 0; });
+    if (result.size() > budget) {
+        std::nth_element(result.begin(), result.begin() + budget, result.end(), [&strength](int a, int b) { return strength[a] > strength[b]; });
+        result.resize(budget);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+PixelSet select_pixels(const Pyramid::Level &level, const Transformation &tsf, int budget)
+{
+    PixelSet result;
+    vector<Pixel> pixels;
+    for (Pixel p : sampling(level.img, tsf.region)) {
+        pixels.push_back(p);
+    }
+    for (int index : strong_pixels(level, tsf.region, budget)) {
+        result.positions.push_back(level.img.to_world(pixels[index]));
+        result.colors.push_back(level.img(pixels[index]));
+    }
+    return result;
+}
+
+InverseCompositional::InverseCompositional(const Transformation &tsf, const Pyramid &ref, int min_size):
+    identity{tsf.region}
+{
+    const int count = level_count(radius(tsf.region), min_size);
+    assert(count <= ref.size());
+    for (int i=0; i<count; ++i) {
+        const Bitmap3 &reference = ref[i].img, &dx = ref[i].dx, &dy = ref[i].dy;
+        Level level;
+        level.scale = reference.scale;
+        for (Pixel p : sampling(reference, tsf.region)) {
+            Sample sample;
+            sample.position = reference.to_world(p);
+            sample.color = reference(p);
+            const std::array<Transformation::Params, 2> jacobian = identity.d(sample.position);
+            // gradients are taken per world unit so that the Gauss-Newton step has the right magnitude
+            Vector3 gradient_x = dx(sample.position) / reference.scale, gradient_y = dy(sample.position) / reference.scale;
+            for (int channel=0; channel<3; ++channel) {
+                Transformation::Params column = gradient_x[channel] * jacobian[0] + gradient_y[channel] * jacobian[1];
+                for (int i=0; i<param_count; ++i) {
+                    sample.descent(i, channel) = column.val[i];
+                }
+            }
+            level.active.push_back(level.samples.size());
+            level.hessian += sample.descent * sample.descent.t();
+            level.samples.push_back(sample);
+        }
+        levels.push_back(std::move(level));
+    }
+}
+
+void InverseCompositional::sparsify(const Pyramid &ref, int budget)
+{
+    for (int i=0; i<levels.size(); ++i) {
+        Level &level = levels[i];
+        level.active = strong_pixels(ref[i], identity.region, budget);
+        if (level.active.size() == level.samples.size()) {
+            // all the samples are kept in the order of sampling, as after construction
+            std::iota(level.active.begin(), level.active.end(), 0);
+        }
+        level.hessian = Hessian();
+        for (int index : level.active) {
+            if (index >= level.samples.size()) {
+                throw std::runtime_error("The pyramid for sparsifying does not match the one used for construction.");
+            }
+            const Sample &sample = level.samples[index];
+            level.hessian += sample.descent * sample.descent.t();
+        }
+    }
+}
+
+void InverseCompositional::refit(Transformation &tsf, const FramePyramid &pyramid) const
+{
+    const int iteration_count = 5;
+    const float min_step = 1e-2;
+    assert(levels.size() <= pyramid.size());
+    vector<Vector2> positions;
+    vector<Vector3> colors;
+    for (int i=levels.size() - 1; i >= 0; --i) {
+        const Level &level = levels[i];
+        const Bitmap3 &view = pyramid[i].img;
+        const int count = level.active.size();
+        positions.resize(count);
+        colors.resize(count);
+        for (int iteration=0; iteration < iteration_count; ++iteration) {
+            // formula : delta_tsf = hessian^-1 * sum_pixel descent^t * (img o tsf - ref)
+            for (int j=0; j<count; ++j) {
+                positions[j] = tsf(level.samples[level.active[j]].position);
+            }
+            view.sample(positions.data(), count, colors.data());
+            Gradient gradient;
+            for (int j=0; j<count; ++j) {
+                const Sample &sample = level.samples[level.active[j]];
+                gradient += sample.descent * (colors[j] - sample.color);
+            }
+            Gradient solution = level.hessian.solve(gradient, cv::DECOMP_CHOLESKY);
+            Transformation::Params delta_tsf;
+            std::copy(solution.val, solution.val + param_count, delta_tsf.val);
+            float step_mag = step_length(delta_tsf, identity);
+            if (not std::isfinite(step_mag)) {
+                break;
+            }
+            tsf.compose_inverse(delta_tsf);
+            if (step_mag < min_step * level.scale) {
+                break;
             }
+        }
+    }
+}
+
+int InverseCompositional::depth() const
+{
+    return levels.size();
+}
+
+void Face::set_solver(Solver chosen)
+{
+    solver = chosen;
+    if (solver == Solver::inverse_compositional and not main_solver) {
+        main_solver.reset(new InverseCompositional(main_tsf, ref_pyramid));
+        if (pixel_budget > 0) {
+            main_solver->sparsify(ref_pyramid, pixel_budget);
+        }
+    }
+}
+
+void Face::set_pixel_budget(int budget)
+{
+    pixel_budget = budget;
+    sparse_pixels.clear();
+    for (int i=0; i<level_count(radius(main_tsf.region), main_min_size); ++i) {
+        sparse_pixels.push_back(select_pixels(ref_pyramid[i], main_tsf, budget));
+    }
+    if (main_solver) {
+        main_solver->sparsify(ref_pyramid, budget);
+    }
+}
+
+int Face::main_depth() const
+{
+    if (solver == Solver::inverse_compositional) {
+        return main_solver->depth();
+    } else if (not sparse_pixels.empty()) {
+        return sparse_pixels.size();
+    }
+    return level_count(radius(main_tsf.region), main_min_size);
+}
+
+void Face::refit(const Bitmap3 &img, bool only_eyes)
+{
+    using Clock = std::chrono::high_resolution_clock;
+    auto seconds_since = [](TimePoint start) { return std::chrono::duration<float>(Clock::now() - start).count(); };
+    const TimePoint time_start = Clock::now();
+    stage_times = StageTimes();
+    FramePyramid view;
+    if (not only_eyes) {
+        // the inverse compositional solver only samples the view, its derivatives are needed by the forward solvers
+        const int depth = main_depth(), children_depth = children.depth();
+        const int derivative_depth = (solver == Solver::inverse_compositional) ? children_depth : std::max(depth, children_depth);
+        view = FramePyramid(img, std::max(depth, children_depth), derivative_depth);
+        if (solver == Solver::inverse_compositional) {
+            main_solver->refit(main_tsf, view);
+        } else if (not sparse_pixels.empty()) {
+            refit_transformation(main_tsf, view, sparse_pixels);
         } else {
+            refit_transformation(main_tsf, view, ref_pyramid, main_min_size);
+        }
+        stage_times.main = seconds_since(time_start);
+    }
+    if (not eye_locator) {
+        static bool has_notified = false;
+        if (not has_notified) {
+            has_notified = true;
+            fprintf(stderr, "Eye tracking has not been set up.\n");
+        }
+    }
+    auto refit_eye = [this, &img, &seconds_since](int i) {
+        if (eye_locator) {
+            const TimePoint time_eye = Clock::now();
             ///@todo Implement Transformation::operator() (Circle)
             Circle view_eye{main_tsf(eyes[i].center), eyes[i].radius * main_tsf.scale(eyes[i].center)};
             eye_locator->refit(view_eye, img);
             fitted_eyes[i] = {main_tsf.inverse(view_eye.center), eyes[i].radius};
+            stage_times.eyes[i] = seconds_since(time_eye);
+        }
+    };
+    // the children and the eyes depend only on the main transformation, so they do not have to wait for each other
+    // the children are the most expensive stage, so each eye gets a quarter of the threads and the children the rest
+    // their parallel loops only use these budgets if nesting has been allowed by set_thread_count, otherwise they run serially
+    int thread_count = 1;
+#ifdef _OPENMP
+    thread_count = omp_get_max_threads();
+#endif
+    const bool is_split = (thread_count >= 3);
+    const int eye_thread_count = std::max(1, thread_count / 4);
+    #pragma omp parallel sections num_threads(3) if (is_split)
+    {
+        #pragma omp section
+        if (not only_eyes) {
+            if (is_split) {
+                set_thread_count(thread_count - 2 * eye_thread_count);
+            }
+            const TimePoint time_children = Clock::now();
+            children.refit(view, main_tsf);
+            stage_times.children = seconds_since(time_children);
+        }
+        #pragma omp section
+        {
+            if (is_split) {
+                set_thread_count(eye_thread_count);
+            }
+            refit_eye(0);
+        }
+        #pragma omp section
+        {
+            if (is_split) {
+                set_thread_count(eye_thread_count);
+            }
+            refit_eye(1);
         }
     }
+    stage_times.total = seconds_since(time_start);
 }
 
 Vector4 Face::operator () () const
@@ -324,6 +860,9 @@ Gaze calibrate_static(Face &state, VideoCapture &cap, TrackingData::const_iterat
 		const float precision = 150;
 		std::cout << "starting to solve..." << std::endl;
 		Gaze result = Gaze::ransac(measurements, support, precision);
+#ifdef GAZE_CERES
+		result = result.refine(measurements, precision);
+#endif
 		for (Measurement pair : measurements) {
 			std::cout << pair.first << " -> " << result(pair.first) << " vs. " << pair.second << ((cv::norm(result(pair.first) - pair.second) < precision) ? " INLIER" : " out") << std::endl;
 		}
@@ -5,6 +5,7 @@
 #include STRINGIFY(TSF_HEADER)
 #include STRINGIFY(CHL_HEADER)
 #include "bitmap.h"
+#include "homography.h"
 #include "eye.h"
 #include "system_paths.h"
 
@@ -14,12 +15,131 @@ class Gaze
 {
     Matrix35 fn;
     Gaze(const Matrix35&);
+    friend class OnlineGaze;
 public:
-    static Gaze ransac(const vector<Measurement>&, int &out_support, float precision=50);
-    static Gaze guess(Safe<vector<Measurement>>&, int &out_support, float precision=50);
+    /** Find the homography agreed on by most measurements, refined on its inliers
+     * @param out_support Necessary count of inliers on input, the actual count on output
+     * @param seed Seed of the random samples, so that the result can be reproduced; zero draws one from std::random_device
+     */
+    static Gaze ransac(const vector<Measurement>&, int &out_support, float precision=50, unsigned seed=0);
+#ifdef GAZE_CERES
+    /** Minimize a robust reprojection error over all the measurements, starting from this estimate
+     * The Cauchy loss of given scale, in screen pixels, suppresses the outliers instead of rejecting them.
+     * @param thread_count Number of threads evaluating the residuals, zero lets OpenMP decide
+     */
+    Gaze refine(const vector<Measurement>&, float precision=50, int thread_count=0) const;
+#endif
     Vector2 operator () (Vector4) const;
 };
 
+/** Gaze estimate that is updated with each new measurement
+ * The normal equations of the linear fit are summed over the current inliers,
+ * so a new measurement costs just a rank-one update and a fixed-size eigendecomposition.
+ * The linear fit is then refined on the inliers by Levenberg-Marquardt, as in Gaze::ransac.
+ * Only the first estimate is found by ransac, later on the inliers are reclassified as the estimate moves.
+ * Until then, ransac is only retried once enough measurements have come to possibly make it succeed.
+ */
+class OnlineGaze
+{
+    using Normal = cv::Matx<double, 15, 15>;
+    const int necessary_support;
+    const float precision;
+    const float tolerance;
+    vector<Measurement> measurements;
+    vector<bool> is_inlier;
+    Normal normal;
+    int support = 0;
+    int stable_count = 0;
+    int next_start = 0;  ///< Count of measurements needed before ransac is tried again
+    int update_count = 0;  ///< Rank-one updates of the normal equations since they were summed afresh
+    bool has_estimate = false;
+    Matrix35 fn;
+    /// Measurements are centered and scaled, as decided when the first estimate is found
+    DltFrame<3, 5> frame;
+    void accumulate(const Measurement&, double weight);
+    void rebuild();
+    int reclassify();
+    void solve();
+    void start();
+public:
+    /** @param tolerance Largest change of the estimate on the inliers, in screen pixels, that still counts as converged
+     */
+    OnlineGaze(int necessary_support=20, float precision=150, float tolerance=10);
+    void add(const Measurement&);
+    bool is_converged() const;
+    Gaze operator () () const;
+};
+
+/** Algorithm used for fitting the main transformation
+ */
+enum class Solver
+{
+    gradient_descent,  /// Additive update with line search, based on gradients of the view
+    inverse_compositional  /// Gauss-Newton steps with steepest descent images precalculated on the reference
+};
+
+/** Reference pixels used for alignment on one pyramid level
+ */
+struct PixelSet
+{
+    vector<Vector2> positions;  /// World coordinates in the reference image
+    vector<Vector3> colors;
+};
+
+/** Inverse compositional image alignment
+ * Steepest descent images and the Gauss-Newton Hessian depend only on the reference image,
+ * so they are calculated once for each pyramid level.
+ * Each iteration then only has to warp the view and accumulate a dot product per pixel.
+ */
+class InverseCompositional
+{
+    static constexpr int param_count = Transformation::Params::channels;
+    using Hessian = cv::Matx<float, param_count, param_count>;
+    using Gradient = cv::Vec<float, param_count>;
+    struct Sample
+    {
+        Vector2 position;  /// World coordinates in the reference image
+        Vector3 color;
+        cv::Matx<float, param_count, 3> descent;  /// Steepest descent images of each color channel
+    };
+    struct Level
+    {
+        float scale;
+        vector<Sample> samples;  /// Every pixel of the region, in the order of sampling
+        vector<int> active;  /// Indices of the samples used for fitting, either all of them or a sparse subset
+        Hessian hessian;  /// Summed over the active samples
+    };
+    const Transformation identity;
+    vector<Level> levels;  /// Finest level first
+public:
+    /** Precompute the descent images on a pyramid of the reference
+     * The coarsest level keeps at least min_size pixels of radius, smaller images make the Hessian degenerate.
+     */
+    InverseCompositional(const Transformation&, const Pyramid &ref, int min_size=10);
+    
+    /** Use only a limited number of samples with strong gradients on each level
+     * The subset is always chosen from all the samples, so the budget can be changed later on.
+     * Has to be called with the pyramid used for construction.
+     */
+    void sparsify(const Pyramid &ref, int budget);
+    void refit(Transformation&, const FramePyramid&) const;
+    
+    /** Number of view pyramid levels read by refit, without derivatives
+     */
+    int depth() const;
+};
+
+/** Wall-clock durations of the stages of one Face::refit, in seconds
+ * The children and both eyes run concurrently, so the total is less than the sum of stages.
+ */
+struct StageTimes
+{
+    float main = 0;
+    float children = 0;
+    std::array<float, 2> eyes = {{0, 0}};
+    float total = 0;
+};
+
 struct Face
 {
     /** Eyes in main reference space
@@ -32,26 +152,80 @@ struct Face
      */
     Bitmap3 ref;
     
+    /** Downscaled reference images and their derivatives, shared by all trackers
+     */
+    Pyramid ref_pyramid;
+    
     /** Transformation from reference to view space
      */
     Transformation main_tsf;
     
     Children children;
+    
+    /** Main transformation fitting, chosen by set_solver
+     */
+    Solver solver = Solver::gradient_descent;
+    
+    /** Precomputed only once the inverse compositional solver is chosen
+     */
+    std::unique_ptr<InverseCompositional> main_solver;
+    
+    /** Limit of pixels on each pyramid level, zero for using all of them
+     */
+    int pixel_budget = 0;
+    
+    /** Reference pixels for the gradient descent solver on each pyramid level, empty for using all of them
+     */
+    vector<PixelSet> sparse_pixels;
+    
+    /** Durations of the last refit
+     */
+    StageTimes stage_times;
+    
     Face(const Bitmap3 &ref, Region, Circle, Circle);
+    
+    /** Choose the algorithm for fitting the main transformation, precomputing whatever it needs
+     */
+    void set_solver(Solver);
+    
+    /** Fit the main transformation only on a limited number of high-gradient pixels on each pyramid level
+     */
+    void set_pixel_budget(int);
+    
+    /** Number of view pyramid levels read by the main transformation fitting
+     */
+    int main_depth() const;
     Vector3 update_step(const Bitmap3 &img, const Bitmap3 &grad, const Bitmap3 &reference, int direction) const;
     void refit(const Bitmap3&, bool only_eyes=false);
     Vector4 operator() () const;
     void render(const Bitmap3&, const char*) const;
 };
 
-void refit_transformation(Transformation&, const Bitmap3&, const Bitmap3&, int min_size=3);
+void refit_transformation(Transformation&, const FramePyramid&, const Pyramid&, int min_size=3);
+void refit_transformation(Transformation&, const FramePyramid&, const vector<PixelSet>&);
+
+/** Choose at most budget pixels with strong gradients within the region of the transformation
+ * The pixels are spread evenly so that the alignment stays well conditioned.
+ */
+PixelSet select_pixels(const Pyramid::Level&, const Transformation&, int budget);
+
+/** Set the number of threads used for fitting the transformations, zero keeps the default of OpenMP
+ * Called from outside any parallel region, it also allows the parallel loops nested in the stages of Face::refit.
+ */
+void set_thread_count(int);
+
 Face init_interactive(const Bitmap3&);
 Face init_static(const Bitmap3&, const string &face_xml=face_classifier_xml, const string &eye_xml=eye_classifier_xml);
 Gaze calibrate_interactive(Face&, VideoCapture&, Pixel window_size=Pixel(1400, 700));
 Gaze calibrate_static(Face&, VideoCapture&, TrackingData::const_iterator&, int frame_step=1);
 
 float line_search(Transformation::Params, float &prev_energy, float max_length, const Transformation&, const Bitmap3&, const Bitmap3&);
+float line_search(Transformation::Params, float &prev_energy, float max_length, const Transformation&, const Bitmap3&, const PixelSet&);
 float step_length(Transformation::Params, const Transformation&);
 float evaluate(const Transformation&, const Bitmap3&, const Bitmap3&);
-Transformation::Params update_step(const Transformation&, const Bitmap3&, const Bitmap3&, const Bitmap3&, int direction);
+float evaluate(const Transformation&, const Bitmap3&, const PixelSet&);
+/** Gradient descent direction of the energy, from image derivatives along both axes in a single pass
+ */
+Transformation::Params update_step(const Transformation&, const Bitmap3 &img, const Bitmap3 &dx, const Bitmap3 &dy, const Bitmap3 &ref);
+Transformation::Params update_step(const Transformation&, const Bitmap3 &img, const Bitmap3 &dx, const Bitmap3 &dy, const PixelSet &ref);
 #endif
@@ -0,0 +1,207 @@
+#include "main.h"
+#include "bitmap.h"
+#include <iostream>
+#include <functional>
+
+/** Unfiltered 2x2 block sum, as downscale used to be implemented
+ */
+template<typename T>
+Bitmap<T> downscale_blocks(const Bitmap<T> &img)
+{
+    Bitmap<T> result(img.rows / 2, img.cols / 2, img.offset);
+    result.scale = 2 * img.scale;
+    result.offset += Vector2(img.scale, img.scale);
+    result = 0 * T();
+    for (Pixel s : sampling(img)) {
+        Pixel d(s.x / 2, s.y / 2);
+        if (d.y < result.rows and d.x < result.cols) {
+            result(d) += img(s);
+        }
+    }
+    return result;
+}
+
+/** Pixel-by-pixel derivative, as Bitmap::d used to be implemented
+ */
+template<typename T>
+Bitmap<T> d_pixelwise(const Bitmap<T> &img, int direction)
+{
+    Vector2 region_offset = img.offset;
+    region_offset(direction) += 0.5 * img.scale;
+    Bitmap<T> result(img.rows - (direction == 1), img.cols - (direction == 0), region_offset, img.scale);
+    const Pixel delta{direction == 0, direction == 1};
+    for (Pixel p : sampling(result)) {
+        result(p) = img(p + delta) - img(p);
+    }
+    return result;
+}
+
+/** Pixel-by-pixel conversion, as Bitmap::grayscale used to be implemented
+ */
+Bitmap1 grayscale_pixelwise(const Bitmap3 &img)
+{
+    Bitmap1 result(img.rows, img.cols, img.offset, img.scale);
+    const Vector3 coef = {0.114, 0.587, 0.299};
+    for (Pixel p : sampling(result)) {
+        result(p) = img(p).dot(coef);
+    }
+    return result;
+}
+
+/** Least squares fit by SVD on dynamic matrices, as the eye locators used to interpolate their maximum
+ */
+Vector2 precise_maximum_svd(const Bitmap1 &score)
+{
+    cv::Point origin;
+    cv::minMaxLoc(score, 0, 0, 0, &origin);
+    origin.x = clamp(origin.x, 1, score.cols - 2);
+    origin.y = clamp(origin.y, 1, score.rows - 2);
+    Matrix system, rhs;
+    for (int x=-1; x<=1; ++x) {
+        for (int y=-1; y<=1; ++y) {
+            Matrix tmp(1, 6);
+            tmp << x*x, x*y, x, y*y, y, 1;
+            system.push_back(tmp);
+            rhs.push_back(score(Pixel(x, y) + origin));
+        }
+    }
+    Matrix v;
+    cv::solve(system, rhs, v, cv::DECOMP_SVD);
+    Matrix polynomial(3, 3);
+    polynomial << 2*v(0), v(1), v(2), v(1), 2*v(3), v(4), v(2), v(4), 2*v(5);
+    Matrix result;
+    cv::solve(polynomial.colRange(0, 2).rowRange(0, 2), polynomial.rowRange(0, 2).col(2), result);
+    return score.to_world(origin) - Vector2(clamp(result(0), -1, 1), clamp(result(1), -1, 1));
+}
+
+template<typename Function>
+float measure(Function fn, int repeat)
+{
+    TimePoint start = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<repeat; ++i) {
+        fn();
+    }
+    return std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count() / repeat;
+}
+
+template<typename T>
+void compare_downscale(const Bitmap<T> &img, const char *name, int repeat)
+{
+    float time_blocks = measure([&img]() { downscale_blocks(img); }, repeat);
+    float time_filtered = measure([&img]() { img.downscale(); }, repeat);
+    printf("downscale %s %ix%i: blocks %.3f ms, filtered %.3f ms, speedup %.2f\n", name, img.cols, img.rows, 1e3 * time_blocks, 1e3 * time_filtered, time_blocks / time_filtered);
+}
+
+template<typename T>
+void compare_d(const Bitmap<T> &img, const char *name, int repeat)
+{
+    for (int direction=0; direction<2; ++direction) {
+        float time_pixelwise = measure([&img, direction]() { d_pixelwise(img, direction); }, repeat);
+        float time_rows = measure([&img, direction]() { img.d(direction); }, repeat);
+        float difference = cv::norm(d_pixelwise(img, direction) - img.d(direction), cv::NORM_INF);
+        printf("d(%i) %s %ix%i: pixelwise %.3f ms, rows %.3f ms, speedup %.2f, max difference %g\n", direction, name, img.cols, img.rows, 1e3 * time_pixelwise, 1e3 * time_rows, time_pixelwise / time_rows, difference);
+    }
+}
+
+void compare_grayscale(const Bitmap3 &img, int repeat)
+{
+    float time_pixelwise = measure([&img]() { grayscale_pixelwise(img); }, repeat);
+    float time_rows = measure([&img]() { img.grayscale(); }, repeat);
+    float difference = cv::norm(grayscale_pixelwise(img) - img.grayscale(), cv::NORM_INF);
+    printf("grayscale %ix%i: pixelwise %.3f ms, rows %.3f ms, speedup %.2f, max difference %g\n", img.cols, img.rows, 1e3 * time_pixelwise, 1e3 * time_rows, time_pixelwise / time_rows, difference);
+}
+
+void compare_sample(const Bitmap3 &img, int repeat)
+{
+    // random positions on a slightly rotated grid, including some outside of the image
+    vector<Vector2> positions;
+    for (int y=-10; y<img.rows + 10; y += 2) {
+        for (int x=-10; x<img.cols + 10; x += 2) {
+            positions.emplace_back(x + 0.1 * y + 0.3, y - 0.1 * x + 0.7);
+        }
+    }
+    vector<Vector3> single(positions.size()), batch(positions.size());
+    float time_single = measure([&]() { std::transform(positions.begin(), positions.end(), single.begin(), [&img](Vector2 v) { return img(v); }); }, repeat);
+    float time_batch = measure([&]() { img.sample(positions.data(), positions.size(), batch.data()); }, repeat);
+    float difference = 0;
+    for (int i=0; i<positions.size(); ++i) {
+        difference = std::max<float>(difference, cv::norm(single[i] - batch[i], cv::NORM_INF));
+    }
+    printf("sample %lu positions: single %.3f ms, batch %.3f ms, speedup %.2f, max difference %g\n", positions.size(), 1e3 * time_single, 1e3 * time_batch, time_single / time_batch, difference);
+}
+
+void compare_peak(int repeat)
+{
+    // elliptic Gaussian blobs at random subpixel positions
+    const int count = 20;
+    vector<Bitmap1> scores;
+    vector<Vector2> centers;
+    cv::RNG rng(1);
+    for (int i=0; i<count; ++i) {
+        Bitmap1 score(32, 32);
+        const Vector2 center(rng.uniform(12.f, 20.f), rng.uniform(12.f, 20.f));
+        const float sx = rng.uniform(1.5f, 4.f), sy = rng.uniform(1.5f, 4.f);
+        for (Pixel p : sampling(score)) {
+            const Vector2 v = to_vector(p) - center;
+            score(p) = std::exp(-0.5 * (pow2(v[0] / sx) + pow2(v[1] / sy))) + rng.uniform(0.f, 0.01f);
+        }
+        scores.push_back(score);
+        centers.push_back(center);
+    }
+    auto average_error = [&](std::function<Vector2(const Bitmap1&)> fn) {
+        float result = 0;
+        for (int i=0; i<count; ++i) {
+            result += cv::norm(fn(scores[i]) - centers[i]) / count;
+        }
+        return result;
+    };
+    float time_svd = measure([&]() { for (const Bitmap1 &score : scores) precise_maximum_svd(score); }, repeat) / count;
+    printf("peak svd: %.4f ms, average error %.3f px\n", 1e3 * time_svd, average_error(precise_maximum_svd));
+    const std::pair<PeakFit, const char*> fits[] = {{PeakFit::parabolic, "parabolic"}, {PeakFit::quadratic, "quadratic"}, {PeakFit::gaussian, "gaussian"}};
+    for (auto fit : fits) {
+        float time = measure([&]() { for (const Bitmap1 &score : scores) find_peak(score, fit.first); }, repeat) / count;
+        float error = average_error([fit](const Bitmap1 &score) { return find_peak(score, fit.first).position; });
+        printf("peak %s: %.4f ms, speedup %.2f, average error %.3f px\n", fit.second, 1e3 * time, time_svd / time, error);
+    }
+    // the refinement alone, without searching for the maximum
+    const Bitmap1 &score = scores.front();
+    cv::Point origin;
+    double low;
+    cv::minMaxLoc(score, &low, 0, 0, &origin);
+    float time_refine = measure([&]() { refine_peak(score, origin, low); }, repeat);
+    printf("refine_peak alone: %.5f ms\n", 1e3 * time_refine);
+}
+
+int main(int argc, char** argv)
+{
+    const int repeat = 100;
+    Bitmap3 image;
+    if (argc > 1) {
+        image.read(argv[1]);
+    } else {
+        image = Bitmap3(720, 1280);
+        cv::randu(image, Vector3(0, 0, 0), Vector3(1, 1, 1));
+    }
+    Bitmap1 gray = image.grayscale();
+    Bitmap2 pair(image.rows, image.cols);
+    for (Pixel p : sampling(pair)) {
+        pair(p) = Vector2(image(p)[0], image(p)[1]);
+    }
+    compare_downscale(gray, "float", repeat);
+    compare_downscale(pair, "Vector2", repeat);
+    compare_downscale(image, "Vector3", repeat);
+    compare_d(gray, "float", repeat);
+    compare_d(image, "Vector3", repeat);
+    compare_grayscale(image, repeat);
+    compare_sample(image, repeat);
+    compare_peak(repeat);
+
+    // the filtered pyramid must keep the brightness of a constant image
+    Bitmap3 flat(image.rows, image.cols);
+    flat = Vector3(0.5, 0.5, 0.5);
+    for (int i=0; i<5; ++i) {
+        flat = flat.downscale();
+    }
+    std::cout << "constant image after 5 levels: " << flat(Pixel(flat.cols / 2, flat.rows / 2)) << std::endl;
+    return 0;
+}
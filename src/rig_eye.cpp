@@ -1,10 +1,70 @@
 #include "main.h"
 #include "eye.h"
 #include <iostream>
+#include <atomic>
+#include <map>
+#include <new>
+#include <numeric>
+#include <cstdlib>
 
 using Annotation = std::tuple<string, string, Circle>;
 
-auto rng = cv::theRNG();
+/// Number of heap allocations so far, by operator new and by the matrices of OpenCV
+std::atomic<long> allocation_count{0};
+
+void* operator new(std::size_t size)
+{
+    allocation_count += 1;
+    if (void *result = std::malloc(size ? size : 1)) {
+        return result;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+/** Matrix allocator that just counts the calls and leaves the work to the standard one
+ */
+class CountingAllocator : public cv::MatAllocator
+{
+    const cv::MatAllocator *base = cv::Mat::getStdAllocator();
+public:
+    cv::UMatData* allocate(int dims, const int *sizes, int type, void *data, size_t *step, int flags, cv::UMatUsageFlags usage) const override
+    {
+        if (not data) {
+            allocation_count += 1;
+        }
+        return base->allocate(dims, sizes, type, data, step, flags, usage);
+    }
+    bool allocate(cv::UMatData *data, int access, cv::UMatUsageFlags usage) const override
+    {
+        return base->allocate(data, access, usage);
+    }
+    void deallocate(cv::UMatData *data) const override
+    {
+        base->deallocate(data);
+    }
+};
+
+/// Annotated eye with its image loaded into memory
+struct Sample
+{
+    string row;
+    Bitmap3 image;
+    Circle truth;
+    vector<Vector2> starts; ///< Perturbed initial positions, the same for all algorithms
+};
+
+/// Statistics of the trials of a single algorithm
+struct Record
+{
+    vector<float> durations, errors;
+    float sum_confidence = 0;
+    long allocations = 0;
+};
 
 float getfloat(std::stringstream &ss, string delim=",")
 {
@@ -35,53 +95,191 @@ vector<Annotation> read_csv(std::istream &in)
     return result;
 }
 
-Vector2 random(float r)
+Vector2 random(cv::RNG &rng, float r)
 {
     return {rng.uniform(-r, r), rng.uniform(-r, r)};
 }
 
+/// Nearest-rank percentile of sorted values
+float percentile(const vector<float> &sorted, float fraction)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[int(clamp(std::ceil(fraction * sorted.size()) - 1, 0, sorted.size() - 1))];
+}
+
+float mean(const vector<float> &values)
+{
+    return values.empty() ? 0 : std::accumulate(values.begin(), values.end(), 0.f) / values.size();
+}
+
+/// Algorithm names are used as JSON strings
+string escape(const string &text)
+{
+    string result;
+    for (char c : text) {
+        if (c == '"' or c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+void print_json(const vector<std::tuple<string, FindEye*>> &algorithms, vector<Record> &records, int sample_count, int trial_count, unsigned seed)
+{
+    printf("{\n  \"samples\": %i,\n  \"trials\": %i,\n  \"seed\": %u,\n  \"algorithms\": [", sample_count, trial_count, seed);
+    for (int j=0; j<algorithms.size(); ++j) {
+        Record &record = records[j];
+        std::sort(record.durations.begin(), record.durations.end());
+        std::sort(record.errors.begin(), record.errors.end());
+        const int calls = record.durations.size();
+        printf("%s\n    {\"name\": \"%s\", \"calls\": %i,\n", j ? "," : "", escape(std::get<0>(algorithms[j])).c_str(), calls);
+        const vector<float> &t = record.durations;
+        printf("     \"latency_ms\": {\"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f},\n", 1e3 * mean(t), 1e3 * percentile(t, 0.5), 1e3 * percentile(t, 0.95), 1e3 * percentile(t, 0.99), 1e3 * percentile(t, 1));
+        printf("     \"allocations_per_call\": %.1f,\n", calls ? float(record.allocations) / calls : 0.f);
+        const vector<float> &e = record.errors;
+        printf("     \"error_px\": {\"mean\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"max\": %.3f},\n", mean(e), percentile(e, 0.5), percentile(e, 0.95), percentile(e, 1));
+        printf("     \"confidence\": %.3f}", calls ? record.sum_confidence / calls : 0.f);
+    }
+    printf("\n  ]\n}\n");
+}
+
+/// Three voting algorithms, refined by LimbusEye
+FindEye* make_voting(bool is_concurrent)
+{
+    auto serial = new SerialEye;
+    auto parallel = new ParallelEye(is_concurrent);
+    parallel->add(FindEyePtr(new HoughEye));
+    parallel->add(FindEyePtr(new CorrelationEye));
+    parallel->add(FindEyePtr(new RadialEye(false)));
+    serial->add(FindEyePtr(parallel));
+    serial->add(FindEyePtr(new LimbusEye));
+    return serial;
+}
+
+/// Cheap localization, falling back to the voting only when it is not confident
+FindEye* make_cascade()
+{
+    auto cheap = new SerialEye;
+    cheap->add(FindEyePtr(new HoughEye));
+    cheap->add(FindEyePtr(new LimbusEye));
+    auto cascade = new CascadeEye;
+    cascade->add(FindEyePtr(cheap), 0.8);
+    cascade->add(FindEyePtr(make_voting(true)));
+    return cascade;
+}
+
 int main(int argc, char** argv)
 {
+    bool is_timing = false;
+    int trial_count = 3;
+    unsigned seed = 0;
+    vector<string> selected;
+    string basepath;
+    for (int i=1; i<argc; ++i) {
+        string arg(argv[i]);
+        if (arg == "-t") {
+            is_timing = true;
+        } else if (arg.size() > 2 and arg.compare(0, 2, "-n") == 0) {
+            trial_count = std::stoi(arg.substr(2));
+        } else if (arg.size() > 2 and arg.compare(0, 2, "-r") == 0) {
+            seed = std::stoul(arg.substr(2));
+        } else if (arg.size() > 2 and arg.compare(0, 2, "-a") == 0) {
+            selected.push_back(arg.substr(2));
+        } else if (arg == "-h") {
+            printf("Usage: rig_eye [-t] [-n<trials>] [-r<seed>] [-a<algorithm>]... [basepath] < annotations.csv\n");
+            printf("\t-t:\tprint a JSON report of latency, allocations and error of each algorithm instead of its results\n");
+            printf("\t-n:\tnumber of perturbed starting positions per eye (default 3)\n");
+            printf("\t-r:\tseed of the perturbations (default 0)\n");
+            printf("\t-a:\trun only the algorithms of that name (default all)\n");
+            return 0;
+        } else {
+            basepath = arg;
+        }
+    }
     auto s1 = new SerialEye;
     s1->add(FindEyePtr(new HoughEye));
     s1->add(FindEyePtr(new LimbusEye));
-    auto s2 = new SerialEye;
-    auto p2 = new ParallelEye;
-    p2->add(FindEyePtr(new HoughEye));
-    p2->add(FindEyePtr(new CorrelationEye));
-    p2->add(FindEyePtr(new RadialEye(false)));
-    s2->add(FindEyePtr(p2));
-    s2->add(FindEyePtr(new LimbusEye));
     vector<std::tuple<string, FindEye*>> algorithms = {
         {"hough", new HoughEye},
+        {"multihough", new MultiHoughEye},
         {"correlation", new CorrelationEye},
         {"bitmap", new BitmapEye("../data/iris.png", 85 / 100.f)},
         {"limbus", new LimbusEye(10)},
         {"radial", new RadialEye(false)},
         {"hough>limbus", s1},
-        {"hough|correlation|radial>limbus", s2},
+        {"hough|correlation|radial>limbus", make_voting(true)},
+        {"hough>limbus?hough|correlation|radial>limbus", make_cascade()},
     };
+    if (is_timing) {
+        algorithms.emplace_back("hough|correlation|radial>limbus sequential", make_voting(false));
+    }
+    if (not selected.empty()) {
+        auto is_unselected = [&selected](const std::tuple<string, FindEye*> &algo) { return std::find(selected.begin(), selected.end(), std::get<0>(algo)) == selected.end(); };
+        algorithms.erase(std::remove_if(algorithms.begin(), algorithms.end(), is_unselected), algorithms.end());
+    }
 
     std::ios_base::sync_with_stdio(false);
     vector<Annotation> annotations = read_csv(std::cin);
     std::ios_base::sync_with_stdio(true);
     
-    string basepath = (argc > 1) ? argv[1] : "";
+    // all images are loaded in advance, so that disk access does not interfere with the measurements
     using std::get;
-    const int repeat = 3;
-    Bitmap3 image;
+    cv::RNG rng(seed);
+    std::map<string, Bitmap3> images;
+    vector<Sample> samples;
     for (const auto &row : annotations) {
-        image.read(basepath + get<1>(row));
-        printf("%s\n", get<0>(row).c_str());
-        for (const auto &algo : algorithms) {
-            for (int i=0; i<repeat; ++i) {
-                Circle c = get<2>(row);
-                c.center += random(c.radius);
-                get<1>(algo)->refit(c, image);
-                Vector2 diff = c.center - get<2>(row).center;
-                printf(" %s,%.2f,%.2f\n", get<0>(algo).c_str(), diff[0], diff[1]);
+        const string filename = basepath + get<1>(row);
+        if (not images.count(filename) and not images[filename].read(filename)) {
+            std::cerr << "Cannot read " << filename << std::endl;
+            images.erase(filename);
+            continue;
+        }
+        Sample sample{get<0>(row), images[filename], get<2>(row)};
+        for (int i=0; i<trial_count; ++i) {
+            sample.starts.push_back(sample.truth.center + random(rng, sample.truth.radius));
+        }
+        samples.push_back(sample);
+    }
+
+    CountingAllocator allocator;
+    cv::Mat::setDefaultAllocator(&allocator);
+    vector<Record> records(algorithms.size());
+    for (int j=0; j<algorithms.size() and not samples.empty(); ++j) {
+        // the first call may fill caches
+        Circle c = samples.front().truth;
+        get<1>(algorithms[j])->refit(c, samples.front().image);
+    }
+    for (const Sample &sample : samples) {
+        if (not is_timing) {
+            printf("%s\n", sample.row.c_str());
+        }
+        for (int j=0; j<algorithms.size(); ++j) {
+            const auto &algo = algorithms[j];
+            Record &record = records[j];
+            for (Vector2 start : sample.starts) {
+                Circle c{start, sample.truth.radius};
+                const long allocations_start = allocation_count;
+                TimePoint time_start = std::chrono::high_resolution_clock::now();
+                const float confidence = get<1>(algo)->refit(c, sample.image);
+                const float duration = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - time_start).count();
+                // read before the record grows, so that only the allocations of the algorithm are counted
+                record.allocations += allocation_count - allocations_start;
+                record.sum_confidence += confidence;
+                record.durations.push_back(duration);
+                Vector2 diff = c.center - sample.truth.center;
+                record.errors.push_back(cv::norm(diff));
+                if (not is_timing) {
+                    printf(" %s,%.2f,%.2f\n", get<0>(algo).c_str(), diff[0], diff[1]);
+                }
             }
         }
     }
+    cv::Mat::setDefaultAllocator(0);
+    if (is_timing) {
+        print_json(algorithms, records, samples.size(), trial_count, seed);
+    }
     return 0;
 }
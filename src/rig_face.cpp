@@ -27,6 +27,11 @@ void print(const Matrix33 &params)
     std::cout << "Main transformation: " << params << std::endl;
 }
 
+void print(const StageTimes &times)
+{
+    printf("Stages: main %.2f ms, children %.2f ms, eyes %.2f and %.2f ms, total %.2f ms\n", 1e3 * times.main, 1e3 * times.children, 1e3 * times.eyes[0], 1e3 * times.eyes[1], 1e3 * times.total);
+}
+
 void match(Face &state, const Bitmap3 &ref, const Bitmap3 &view, bool is_verbose)
 {
     TimePoint time_start = std::chrono::high_resolution_clock::now();
@@ -38,6 +43,7 @@ void match(Face &state, const Bitmap3 &ref, const Bitmap3 &view, bool is_verbose
     if (is_verbose) {
         print(state.main_tsf.params);
         std::cout << "Face parameters: " << state() << ", " << 1 / duration << " fps" << std::endl;
+        print(state.stage_times);
     }
     state.render(view, "view");
     cv::waitKey();
@@ -45,13 +51,15 @@ void match(Face &state, const Bitmap3 &ref, const Bitmap3 &view, bool is_verbose
 
 int main(int argc, char** argv)
 {
-	bool is_interactive = false, is_verbose = false;
+	bool is_interactive = false, is_verbose = false, is_compositional = false;
 	for (int i=1; i<argc; ++i) {
 		string arg(argv[i]);
 		if (arg == "-i") {
 			is_interactive = true;
 		} else if (arg == "-v") {
 			is_verbose = true;
+		} else if (arg == "-c") {
+			is_compositional = true;
         }
     }
     using std::atof;
@@ -60,6 +68,9 @@ int main(int argc, char** argv)
     assert(view.read(argv[2]));
     try {
         Face state = (is_interactive) ? init_interactive(ref) : init_static(ref);
+        if (is_compositional) {
+            state.set_solver(Solver::inverse_compositional);
+        }
         match(state, ref, view, is_verbose);
     } catch (NoFaceException) {
         std::cerr << "No face initialized." << std::endl;
@@ -0,0 +1,142 @@
+#include "main.h"
+#include "bitmap.h"
+#include "optimization.h"
+#include <iostream>
+#include <numeric>
+
+/** Synthetic calibration: both eyes look at a screen of 1400x700 pixels
+ * The true mapping is a mild perspective of the normalized eye positions,
+ * each measurement has Gaussian noise on the screen and some of them are replaced by random points.
+ */
+struct Scene
+{
+    Matrix35 normalized;
+    Vector4 shift;
+
+    Scene(cv::RNG &rng)
+    {
+        for (float &value : normalized.val) {
+            value = rng.uniform(-0.1f, 0.1f);
+        }
+        normalized(0, 0) += 1;
+        normalized(1, 1) += 1;
+        normalized(2, 4) += 1;
+        for (int i=0; i<4; ++i) {
+            shift[i] = rng.uniform(-1e3f, 1e3f);
+        }
+    }
+
+    Vector4 eyes(cv::RNG &rng) const
+    {
+        const float u = rng.uniform(-1.f, 1.f), v = rng.uniform(-1.f, 1.f);
+        return 100 * Vector4(u, v, u + rng.gaussian(0.02), v + rng.gaussian(0.02)) + shift;
+    }
+
+    Vector2 truth(Vector4 eyes) const
+    {
+        const Vector2 p = project((eyes - shift) / 100, normalized);
+        return Vector2(700 + 600 * p[0], 350 + 300 * p[1]);
+    }
+
+    vector<Measurement> generate(cv::RNG &rng, int count, float outlier_ratio, float noise) const
+    {
+        vector<Measurement> result;
+        for (int i=0; i<count; ++i) {
+            const Vector4 x = eyes(rng);
+            Vector2 y = truth(x) + Vector2(rng.gaussian(noise), rng.gaussian(noise));
+            if (rng.uniform(0.f, 1.f) < outlier_ratio) {
+                y = Vector2(rng.uniform(0.f, 1400.f), rng.uniform(0.f, 700.f));
+            }
+            result.emplace_back(x, y);
+        }
+        return result;
+    }
+};
+
+/// Statistics of one method over all repetitions of a configuration
+struct Record
+{
+    string method;
+    int count;
+    float outlier_ratio;
+    vector<float> durations, errors;
+};
+
+/** Error of the fit against the true mapping, on measurements not used for fitting
+ * The test positions are drawn from their own seed, so that all methods are compared on the same ones.
+ */
+float test_error(const Gaze &gaze, const Scene &scene, unsigned seed)
+{
+    cv::RNG rng(seed);
+    const int count = 100;
+    float result = 0;
+    for (int i=0; i<count; ++i) {
+        const Vector4 x = scene.eyes(rng);
+        result += cv::norm(gaze(x) - scene.truth(x)) / count;
+    }
+    return result;
+}
+
+float median(vector<float> values)
+{
+    std::sort(values.begin(), values.end());
+    return values.empty() ? 0 : values[values.size() / 2];
+}
+
+float mean(const vector<float> &values)
+{
+    return values.empty() ? 0 : std::accumulate(values.begin(), values.end(), 0.f) / values.size();
+}
+
+int main(int argc, char** argv)
+{
+    int repetitions = 10;
+    unsigned seed = 0;
+    const float noise = 20, precision = 50;
+    for (int i=1; i<argc; ++i) {
+        string arg(argv[i]);
+        if (arg.size() > 2 and arg.compare(0, 2, "-n") == 0) {
+            repetitions = std::stoi(arg.substr(2));
+        } else if (arg.size() > 2 and arg.compare(0, 2, "-r") == 0) {
+            seed = std::stoul(arg.substr(2));
+        } else {
+            printf("Usage: rig_gaze [-n<repetitions>] [-r<seed>]\n");
+            printf("\t-n:\tnumber of random scenes for each configuration (default 10)\n");
+            printf("\t-r:\tseed of the scenes and of ransac (default 0)\n");
+            return 0;
+        }
+    }
+    cv::RNG rng(seed);
+    vector<Record> records;
+    for (int count : {50, 200, 1000}) {
+        for (float outlier_ratio : {0.f, 0.2f, 0.4f}) {
+            Record ransac{"ransac", count, outlier_ratio}, ceres{"ransac+ceres", count, outlier_ratio};
+            for (int i=0; i<repetitions; ++i) {
+                const Scene scene(rng);
+                const vector<Measurement> measurements = scene.generate(rng, count, outlier_ratio, noise);
+                // ransac draws its own seed from zero, so a nonzero one keeps the whole run reproducible
+                const unsigned ransac_seed = rng.next() | 1, test_seed = rng.next();
+                TimePoint time_start = std::chrono::high_resolution_clock::now();
+                int support = count * (1 - outlier_ratio) / 2;
+                const Gaze gaze = Gaze::ransac(measurements, support, precision, ransac_seed);
+                ransac.durations.push_back(std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - time_start).count());
+                ransac.errors.push_back(test_error(gaze, scene, test_seed));
+#ifdef GAZE_CERES
+                time_start = std::chrono::high_resolution_clock::now();
+                const Gaze refined = gaze.refine(measurements, precision);
+                ceres.durations.push_back(ransac.durations.back() + std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - time_start).count());
+                ceres.errors.push_back(test_error(refined, scene, test_seed));
+#endif
+            }
+            records.push_back(ransac);
+            if (not ceres.durations.empty()) {
+                records.push_back(ceres);
+            }
+        }
+    }
+    printf("points,outliers,method,mean_ms,median_ms,mean_error,median_error\n");
+    for (const Record &record : records) {
+        printf("%i,%.2f,%s,%.3f,%.3f,%.3f,%.3f\n", record.count, record.outlier_ratio, record.method.c_str(), 1e3 * mean(record.durations), 1e3 * median(record.durations), mean(record.errors), median(record.errors));
+    }
+    return 0;
+}
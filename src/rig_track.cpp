@@ -0,0 +1,94 @@
+// Compare dense and sparse alignment of the face on a recorded video, the dense tracker serves as the reference
+#include "main.h"
+#include "bitmap.h"
+#include "optimization.h"
+#include <iostream>
+
+float vertex_difference(const Transformation &a, const Transformation &b)
+{
+    float result = 0;
+    for (Vector2 v : a.vertices()) {
+        result = std::max<float>(result, cv::norm(a(v) - b(v)));
+    }
+    return result;
+}
+
+void display_help()
+{
+	printf("Usage: rig_track [-c] [-s<pixels>] video.avi\n");
+	printf("\t-c:\tinverse compositional face tracking\n");
+	printf("\t-s:\tnumber of pixels per pyramid level in sparse mode (default 1000)\n");
+}
+
+int main(int argc, char** argv)
+{
+	bool is_compositional = false;
+	int budget = 1000;
+	string video_filename;
+	for (int i=1; i<argc; ++i) {
+		string arg(argv[i]);
+		if (arg == "-c") {
+			is_compositional = true;
+		} else if (arg.size() > 2 and arg.compare(0, 2, "-s") == 0) {
+			budget = std::stoi(arg.substr(2));
+		} else if (arg == "-h") {
+			display_help();
+			return 0;
+		} else {
+			video_filename = arg;
+		}
+	}
+	if (video_filename.empty()) {
+		display_help();
+		return 1;
+	}
+	set_thread_count(0);
+    VideoCapture cam{video_filename};
+    Bitmap3 image;
+    if (not image.read(cam)) {
+        std::cerr << "Cannot read " << video_filename << std::endl;
+        return 1;
+    }
+    try {
+        Face dense = init_static(image), sparse = init_static(image);
+        sparse.set_pixel_budget(budget);
+        if (is_compositional) {
+            dense.set_solver(Solver::inverse_compositional);
+            sparse.set_solver(Solver::inverse_compositional);
+        }
+        float time_dense = 0, time_sparse = 0, sum_difference = 0, max_difference = 0;
+        StageTimes stages_dense;
+        int frame_count = 0;
+        while (image.read(cam)) {
+            TimePoint time_start = std::chrono::high_resolution_clock::now();
+            dense.refit(image);
+            TimePoint time_middle = std::chrono::high_resolution_clock::now();
+            stages_dense.main += dense.stage_times.main;
+            stages_dense.children += dense.stage_times.children;
+            stages_dense.eyes[0] += dense.stage_times.eyes[0];
+            stages_dense.eyes[1] += dense.stage_times.eyes[1];
+            stages_dense.total += dense.stage_times.total;
+            sparse.refit(image);
+            TimePoint time_end = std::chrono::high_resolution_clock::now();
+            time_dense += std::chrono::duration<float>(time_middle - time_start).count();
+            time_sparse += std::chrono::duration<float>(time_end - time_middle).count();
+            float difference = vertex_difference(dense.main_tsf, sparse.main_tsf);
+            sum_difference += difference;
+            max_difference = std::max(max_difference, difference);
+            frame_count += 1;
+        }
+        if (frame_count == 0) {
+            std::cerr << "No frames to track." << std::endl;
+            return 1;
+        }
+        printf("%i frames, %i pixels per level\n", frame_count, budget);
+        printf("dense: %.2f ms per frame\n", 1e3 * time_dense / frame_count);
+        printf("dense stages: main %.2f, children %.2f, eyes %.2f and %.2f, total %.2f ms per frame\n", 1e3 * stages_dense.main / frame_count, 1e3 * stages_dense.children / frame_count, 1e3 * stages_dense.eyes[0] / frame_count, 1e3 * stages_dense.eyes[1] / frame_count, 1e3 * stages_dense.total / frame_count);
+        printf("sparse: %.2f ms per frame, speedup %.2f\n", 1e3 * time_sparse / frame_count, time_dense / time_sparse);
+        printf("difference of sparse from dense: average %.3f px, maximum %.3f px\n", sum_difference / frame_count, max_difference);
+    } catch (NoFaceException) {
+        std::cerr << "No face initialized." << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -27,18 +27,26 @@ void print(const Matrix33 &params)
     std::cout << "Main transformation: " << params << std::endl;
 }
 
+void print(const StageTimes &times)
+{
+    printf("Stages: main %.2f ms, children %.2f ms, eyes %.2f and %.2f ms, total %.2f ms\n", 1e3 * times.main, 1e3 * times.children, 1e3 * times.eyes[0], 1e3 * times.eyes[1], 1e3 * times.total);
+}
+
 std::basic_ostream<char> &operator<<(std::basic_ostream<char> &stream, const Triangle &t)
 {
     return (stream << "[a = " << t[0] << ", b = " << t[1] << ", c = " << t[2] << "]");
 }
     
-void track_interactive(VideoCapture &cam, bool is_interactive, bool is_verbose)
+void track_interactive(VideoCapture &cam, bool is_interactive, bool is_verbose, bool is_compositional)
 {
     Bitmap3 image;
     for (int i=0; i<10; i++) {
         assert (image.read(cam));
     }
     Face state = (is_interactive) ? init_interactive(image) : init_static(image);
+    if (is_compositional) {
+        state.set_solver(Solver::inverse_compositional);
+    }
     if (1) {
         auto serial = new SerialEye;
         serial->add(FindEyePtr(new HoughEye(Vector3(0.7, 0, 0))));
@@ -65,6 +73,7 @@ void track_interactive(VideoCapture &cam, bool is_interactive, bool is_verbose)
             //std::cout << "Main transformation: " << state.main_tsf.params << ", face parameters: " << state() << ", " << 1 / duration << " fps" << std::endl;
             print(state.main_tsf.params);
             std::cout << "Face parameters: " << state() << ", " << 1 / duration << " fps" << std::endl;
+            print(state.stage_times);
             time_prev = time_now;
         }
         state.render(image, "tracking");
@@ -75,18 +84,20 @@ void track_interactive(VideoCapture &cam, bool is_interactive, bool is_verbose)
 
 int main(int argc, char** argv)
 {
-	bool is_interactive = false, is_verbose = false;
+	bool is_interactive = false, is_verbose = false, is_compositional = false;
 	for (int i=1; i<argc; ++i) {
 		string arg(argv[i]);
 		if (arg == "-i") {
 			is_interactive = true;
 		} else if (arg == "-v") {
 			is_verbose = true;
+		} else if (arg == "-c") {
+			is_compositional = true;
         }
     }
     VideoCapture cam{0};
     try {
-        track_interactive(cam, is_interactive, is_verbose);
+        track_interactive(cam, is_interactive, is_verbose, is_compositional);
     } catch (NoFaceException) {
         std::cerr << "No face initialized." << std::endl;
         return 1;
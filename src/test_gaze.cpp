@@ -46,6 +46,25 @@ vector<Measurement> generate_random(int count)
     return result;
 }
 
+/** Measurements of a mild homography arriving one by one, some of them replaced by random points
+ * Both eyes look the same way up to a little noise, so the linear fit is close to degenerate as with real eyes.
+ */
+vector<Measurement> generate_stream(const Matrix35 &h, int count, float outlier_ratio)
+{
+    vector<Measurement> result;
+    cv::RNG &rng = cv::theRNG();
+    for (int i=0; i<count; ++i) {
+        const float u = rng.uniform(-1.f, 1.f), v = rng.uniform(-1.f, 1.f);
+        const Vector4 x(u, v, u + rng.gaussian(0.02), v + rng.gaussian(0.02));
+        Vector2 y = dehomogenize(h * homogenize(x)) + Vector2(rng.gaussian(1e-3), rng.gaussian(1e-3));
+        if (rng.uniform(0.f, 1.f) < outlier_ratio) {
+            cv::randu(y, -2, 2);
+        }
+        result.push_back(std::make_pair(100 * x, 100 * y));
+    }
+    return result;
+}
+
 void print(const vector<Measurement> &sample, const Gaze &fit)
 {
     std::cout << "Fitted homography (input -> true output vs. fitted output):" << std::endl;
@@ -79,5 +98,37 @@ int main(int argc, char** argv)
         Gaze fit = Gaze::ransac(sample, support, 0.1);
         print(sample, fit);
     }
+    std::cout << "=== Fitting online ===" << std::endl;
+    Matrix35 mild = 0.1 * random_homography();
+    mild(0, 0) += 1;
+    mild(1, 1) += 1;
+    mild(2, 4) += 1;
+    for (float outlier_ratio : {0.f, 0.2f, 0.4f}) {
+        std::cout << "== " << outlier_ratio << " outliers ==" << std::endl;
+        vector<Measurement> stream = generate_stream(mild, 300, outlier_ratio);
+        OnlineGaze online(20, 1, 0.1);
+        int converged_count = 0;
+        for (const Measurement &m : stream) {
+            online.add(m);
+            converged_count += 1;
+            if (online.is_converged()) {
+                break;
+            }
+        }
+        if (online.is_converged()) {
+            std::cout << "\tConverged after " << converged_count << " measurements" << std::endl;
+        } else {
+            std::cout << "\tNot converged after " << converged_count << " measurements" << std::endl;
+        }
+        // later measurements keep the estimate in place, its error against the truth should stay below the precision
+        for (int i=converged_count; i<stream.size(); ++i) {
+            online.add(stream[i]);
+        }
+        const vector<Measurement> test = generate_stream(mild, 10, 0);
+        print(test, online());
+        // the batch fit on all the measurements serves as a reference, the online one should not be worse
+        int support = 20;
+        print(test, Gaze::ransac(stream, support, 1));
+    }
     return 0;
 }
@@ -56,11 +56,28 @@ Transformation& Transformation::operator += (Params delta)
     return *this;
 }
 
+Transformation& Transformation::compose_inverse(Params delta)
+{
+    // the update is D(x) = x + t + s * M * (x - c), so that D^-1(x) = c + (I + s * M)^-1 * (x - c - t)
+    Matrix22 inv_step = (Matrix22::eye() + static_params.second * extract_matrix(delta)).inv();
+    params.second = params.second * inv_step;
+    params.first -= static_params.second * params.second * extract_translation(delta);
+    return *this;
+}
+
 Vector2 Transformation::operator () (Vector2 v) const
 {
     return params.first + static_params.second * params.second * (v - static_params.first);
 }
 
+void Transformation::operator () (Vector2 start, Vector2 step, int count, Vector2 *out) const
+{
+    Vector2 origin = (*this)(start), delta = static_params.second * params.second * step;
+    for (int i=0; i<count; ++i) {
+        out[i] = origin + float(i) * delta;
+    }
+}
+
 Params Transformation::d(Vector2 v, int direction) const
 {
     v -= static_params.first;
@@ -68,6 +85,13 @@ Params Transformation::d(Vector2 v, int direction) const
     return (direction == 0) ? Params{1, 0, coef * v[0], coef * v[1], 0, 0} : Params{0, 1, 0, 0, coef * v[0], coef * v[1]};
 }
 
+std::array<Params, 2> Transformation::d(Vector2 v) const
+{
+    v -= static_params.first;
+    float coef = static_params.second;
+    return {{Params{1, 0, coef * v[0], coef * v[1], 0, 0}, Params{0, 1, 0, 0, coef * v[0], coef * v[1]}}};
+}
+
 Region Transformation::operator () (Region region) const
 {
     const Transformation &self = *this;
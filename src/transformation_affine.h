@@ -14,8 +14,10 @@ struct Transformation
     Transformation& operator = (const Transformation&);
     Transformation operator + (Params) const;
     Transformation& operator += (Params);
+    Transformation& compose_inverse(Params);
     Vector2 operator () (Vector2) const;
     Vector2 operator () (Pixel p) const { return (*this)(to_vector(p)); }
+    void operator () (Vector2 start, Vector2 step, int count, Vector2 *out) const;
     Region operator () (Region) const;
     
     float scale(Vector2) const;
@@ -23,6 +25,7 @@ struct Transformation
     Transformation inverse() const;
     Vector2 inverse(Vector2) const;
     Params d(Vector2, int direction) const;
+    std::array<Params, 2> d(Vector2) const;
     std::array<Vector2, 4> vertices() const;
 };
 
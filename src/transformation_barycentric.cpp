@@ -40,6 +40,18 @@ inline Matrix23 hmerge(const Matrix22 &l, const Matrix21 &r)
 	return result;
 }
 
+/// Extend an affine transformation to a square matrix
+inline Matrix33 to_square(const Matrix23 &mat)
+{
+	Matrix33 result = Matrix33::eye();
+	for (int i=0; i<2; ++i) {
+		for (int j=0; j<3; ++j) {
+			result(i, j) = mat(i, j);
+		}
+	}
+	return result;
+}
+
 inline Matrix23 dehomogenize(const Matrix33 &mat)
 {
 	return mat.get_minor<2, 3>(0, 0);
@@ -111,6 +123,15 @@ Transformation& Transformation::operator += (const Params &delta)
     return *this;
 }
 
+Transformation& Transformation::compose_inverse(const Params &delta)
+{
+	Matrix33 reference_points = static_params.inv();
+	Matrix33 step = to_square((dehomogenize(reference_points) + delta) * static_params);
+	points = params * step.inv() * reference_points;
+	update_params();
+	return *this;
+}
+
 Transformation& Transformation::increment(Vector2 delta, int index)
 {
     add_col(points, index, delta);
@@ -123,6 +144,14 @@ Vector2 Transformation::operator () (Vector2 v) const
 	return params * homogenize(v);
 }
 
+void Transformation::operator () (Vector2 start, Vector2 step, int count, Vector2 *out) const
+{
+	Vector2 origin = params * homogenize(start), delta = params * Vector3(step[0], step[1], 0);
+	for (int i=0; i<count; ++i) {
+		out[i] = origin + float(i) * delta;
+	}
+}
+
 Params Transformation::d(Vector2 v, int direction) const
 {
 	Params result = Params::zeros();
@@ -133,6 +162,17 @@ Params Transformation::d(Vector2 v, int direction) const
 	return result;
 }
 
+std::array<Params, 2> Transformation::d(Vector2 v) const
+{
+	std::array<Params, 2> result = {{Params::zeros(), Params::zeros()}};
+	Vector3 row = static_params * homogenize(v);
+	for (int j=0; j<3; ++j) {
+		result[0](0, j) = row(j);
+		result[1](1, j) = row(j);
+	}
+	return result;
+}
+
 Region Transformation::operator () (Region r) const
 {
     const Transformation &self = *this;
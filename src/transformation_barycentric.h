@@ -16,9 +16,11 @@ struct Transformation
     Transformation& operator = (const Transformation&);
     Transformation operator + (const Params&) const;
     Transformation& operator += (const Params&);
+    Transformation& compose_inverse(const Params&);
     Transformation& increment(Vector2, int);
     Vector2 operator () (Vector2) const;
     Vector2 operator () (Pixel p) const { return (*this)(to_vector(p)); }
+    void operator () (Vector2 start, Vector2 step, int count, Vector2 *out) const;
     Region operator () (Region) const;
     Triangle operator () (Triangle) const;
     Transformation operator () (Transformation) const;
@@ -29,6 +31,7 @@ struct Transformation
     Vector2 inverse(Vector2 v) const { return inverse()(v); }
     Transformation inverse(Transformation) const;
     Params d(Vector2, int direction) const;
+    std::array<Params, 2> d(Vector2) const;
     Triangle vertices() const;
 protected:
     void update_params(); /// recalculate params after a modification of points
@@ -29,6 +29,12 @@ struct Transformation
     Transformation operator + (Params) const;
     Transformation& operator += (Params);
 
+    /** Compose with the inverse of a differential update in reference space
+     * The result maps x to the current transformation of D^-1(x), where D is the identity increased by the params.
+     * Used by the inverse compositional solver.
+     */
+    Transformation& compose_inverse(Params);
+
     /** Modify a vertex of a cage-based transformation
      * (only available in barycentric and perspective)
      */
@@ -38,6 +44,11 @@ struct Transformation
 	 */
     Vector2 operator () (Vector2) const;
     Vector2 operator () (Pixel p) const { return (*this)(to_vector(p)); }
+
+    /** Transform a row of equally spaced points, start + i * step for i < count
+     * The points are calculated incrementally, which is much cheaper than transforming each of them.
+     */
+    void operator () (Vector2 start, Vector2 step, int count, Vector2 *out) const;
 	
 	/** Transform a bounding box from reference to view space
 	 */
@@ -58,6 +69,11 @@ struct Transformation
      */
     Params d(Vector2, int direction) const;
     
+    /** Derivatives of both view coordinates wrt. params, the same as d(v, 0) and d(v, 1)
+     * Shared calculations are done just once, so this is cheaper than two separate calls.
+     */
+    std::array<Params, 2> d(Vector2) const;
+    
     /** Return the extremal points of the region
      */
     std::array<Vector2, N> vertices() const;
@@ -56,6 +56,16 @@ Transformation& Transformation::operator += (const Params &delta)
     return *this;
 }
 
+Transformation& Transformation::compose_inverse(const Params &delta)
+{
+    params.second -= extract_angle(delta);
+    float s, c;
+    sincos(s, c);
+    Matrix22 rot = {c, -s, s, c};
+    params.first -= rot * extract_translation(delta);
+    return *this;
+}
+
 Vector2 Transformation::operator () (Vector2 v) const
 {
     float s, c;
@@ -64,6 +74,17 @@ Vector2 Transformation::operator () (Vector2 v) const
     return params.first + rot * (v - static_params.first);
 }
 
+void Transformation::operator () (Vector2 start, Vector2 step, int count, Vector2 *out) const
+{
+    float s, c;
+    sincos(s, c);
+    Matrix22 rot = {c, -s, s, c};
+    Vector2 origin = params.first + rot * (start - static_params.first), delta = rot * step;
+    for (int i=0; i<count; ++i) {
+        out[i] = origin + float(i) * delta;
+    }
+}
+
 Params Transformation::d(Vector2 v, int direction) const
 {
     float s, c;
@@ -72,6 +93,14 @@ Params Transformation::d(Vector2 v, int direction) const
     return (direction == 0) ? Params{1, 0, coef * (-v[0] * s - v[1] * c)} : Params{0, 1, coef * (v[0] * c - v[1] * s)};
 }
 
+std::array<Params, 2> Transformation::d(Vector2 v) const
+{
+    float s, c;
+    float coef = sincos(s, c);
+    v -= static_params.first;
+    return {{Params{1, 0, coef * (-v[0] * s - v[1] * c)}, Params{0, 1, coef * (v[0] * c - v[1] * s)}}};
+}
+
 Region Transformation::operator () (Region r) const
 {
     const Transformation &self = *this;
@@ -158,6 +158,21 @@ Transformation& Transformation::operator += (const Params &delta)
     return *this;
 }
 
+Transformation& Transformation::compose_inverse(const Params &delta)
+{
+    PointPack step_points = static_params;
+    for (int i=0; i<step_points.size(); ++i) {
+        step_points[i] += extract_point(delta, i);
+    }
+    Matrix33 step = homography<3, 3>(zip_measurements(static_params, step_points));
+    Matrix33 composite = params * step.inv();
+    for (int i=0; i<points.size(); ++i) {
+        points[i] = project(static_params[i], composite);
+    }
+    update_params(composite);
+    return *this;
+}
+
 Transformation& Transformation::increment(Vector2 delta, int index)
 {
     points[index] += delta;
@@ -170,20 +185,31 @@ Vector2 Transformation::operator () (Vector2 v) const
     return project(v, params);
 }
 
+void Transformation::operator () (Vector2 start, Vector2 step, int count, Vector2 *out) const
+{
+    // the homogeneous coordinate changes linearly along the row, only the division remains per point
+    Vector3 origin = params * homogenize(start), delta = params * Vector3(step[0], step[1], 0);
+    for (int i=0; i<count; ++i) {
+        out[i] = dehomogenize(origin + float(i) * delta);
+    }
+}
+
 Params Transformation::d(Vector2 v, int direction) const
 {
-	static Vector2 stored_v(HUGE_VALF, HUGE_VALF);
-    static array<array<Vector2, 2>, 4> result_vectors;
-	if (not (exchange(stored_v, v) == v)) {
-	    Vector2 projected_v = project(v, params);
-	    for (int i=0; i<4; ++i) {
-	        Vector3 canonized_v = canonize_matrix[i] * homogenize(v);
-	        for (int j=0; j<2; ++j) {
-		        result_vectors[i][j] = projection_derivative(projected_v, weight_vector[i].dot(canonized_v), derivative_matrix[i][j] * canonized_v);
-			}
-	    }
-	}
-    return pack_vectors(result_vectors, direction);
+    return d(v)[direction];
+}
+
+std::array<Params, 2> Transformation::d(Vector2 v) const
+{
+    array<array<Vector2, 2>, 4> result_vectors;
+    Vector2 projected_v = project(v, params);
+    for (int i=0; i<4; ++i) {
+        Vector3 canonized_v = canonize_matrix[i] * homogenize(v);
+        for (int j=0; j<2; ++j) {
+            result_vectors[i][j] = projection_derivative(projected_v, weight_vector[i].dot(canonized_v), derivative_matrix[i][j] * canonized_v);
+        }
+    }
+    return {{pack_vectors(result_vectors, 0), pack_vectors(result_vectors, 1)}};
 }
 
 Region Transformation::operator () (Region region) const
@@ -16,9 +16,11 @@ struct Transformation
     Transformation& operator = (const Transformation&);
     Transformation operator + (const Params&) const;
     Transformation& operator += (const Params&);
+    Transformation& compose_inverse(const Params&);
     Transformation& increment(Vector2, int);
     Vector2 operator () (Vector2) const;
     Vector2 operator () (Pixel p) const { return (*this)(to_vector(p)); }
+    void operator () (Vector2 start, Vector2 step, int count, Vector2 *out) const;
     Region operator () (Region) const;
     Transformation operator () (Transformation) const;
     
@@ -28,6 +30,7 @@ struct Transformation
     Vector2 inverse(Vector2) const;
     Transformation inverse(Transformation) const;
     Params d(Vector2, int direction) const;
+    std::array<Params, 2> d(Vector2) const;
     std::array<Vector2, 4> vertices() const;
 protected:
     const array<Matrix33, 4> canonize_matrix;  /// Homography for static_params into canonical configuration for their four permutations
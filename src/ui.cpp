@@ -266,21 +266,35 @@ void Face::render(const Bitmap3 &image, const char *winname) const
 
 void gaze_thread(Measurements &measurements, std::unique_ptr<Gaze> &result)
 {
-    const int necessary_support = 20;
     const float precision = 150;
-    while (measurements.size() < necessary_support) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    }
-    std::cout << "starting the solve thread" << std::endl;
-    while (1) {
-        int support = necessary_support;
-        Gaze candidate = Gaze::guess(measurements, support, precision);
-        if (support >= necessary_support) {
-            result.reset(new Gaze(candidate));
-            break;
+    OnlineGaze estimate(20, precision);
+    int count = 0;
+    vector<Measurement> incoming;
+    while (not estimate.is_converged()) {
+        {
+            Lock lk(measurements);
+            incoming.assign(measurements.begin() + count, measurements.end());
         }
+        if (incoming.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        count += incoming.size();
+        for (const Measurement &pair : incoming) {
+            estimate.add(pair);
+        }
+    }
+#ifdef GAZE_CERES
+    {
+        Lock lk(measurements);
+        incoming.assign(measurements.begin(), measurements.end());
     }
+    result.reset(new Gaze(estimate().refine(incoming, precision)));
+#else
+    result.reset(new Gaze(estimate()));
+#endif
     const Gaze &gaze = *result;
+    Lock lk(measurements);
     for (auto pair : measurements) {
         std::cout << pair.first << " -> " << gaze(pair.first) << " vs. " << pair.second << ((cv::norm(gaze(pair.first) - pair.second) < precision) ? " INLIER" : " out") << std::endl;
     }